@@ -1,15 +1,6 @@
 #include <stdio.h>
 
-static inline void cpuid(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
-{
-    asm volatile("cpuid"
-                 : "=a" (*eax)
-                 , "=b" (*ebx)
-                 , "=c" (*ecx)
-                 , "=d" (*edx)
-                 : "0" (*eax)
-                 , "2" (*ecx));
-}
+#include "cpuid.h"
 
 int main(int argc, char **argv)
 {
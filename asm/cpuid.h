@@ -0,0 +1,15 @@
+#ifndef CPUID_H
+#define CPUID_H
+
+static inline void cpuid(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
+{
+    asm volatile("cpuid"
+                 : "=a" (*eax)
+                 , "=b" (*ebx)
+                 , "=c" (*ecx)
+                 , "=d" (*edx)
+                 : "0" (*eax)
+                 , "2" (*ecx));
+}
+
+#endif // CPUID_H
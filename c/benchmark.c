@@ -1,22 +1,33 @@
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
-#include <time.h>
+#include "benchmark.h"
 
-// source: http://zserge.com/blog/c-for-loop-tricks.html
+// gcc -O2 benchmark.c -lm && ./a.out -p -j results.json
 
-#define BENCH_CLOCK() ((float)clock() * 1000000000L / CLOCKS_PER_SEC)
+int main(int argc, char **argv) {
+    static char src[4096], dst[4096];
+    double x = 0.5;
 
-// _i will execute the printf but take the value of _iter (comma operator)
-// the right side of the || will only be executed once the left side is no longer true (short circuit)
-// the right side always evaluates to 0 (comma operator)
-#define BENCH(_name, _iter)                                                                             \
-    for (long _start_ns = BENCH_CLOCK(), _i = (printf("START: %15s\n", _name), _iter);                  \
-         _i > 0 || (printf("BENCH: %15s: %f ns/op\n", _name, (BENCH_CLOCK() - _start_ns) / _iter), 0);  \
-         _i--)
+    if (bench_parse_args(argc, argv) < 0)
+        return 1;
 
-int main() {
-    BENCH("sleep", 10L) {
-        printf("Sleeping for another %ld seconds\n", _i);
-        sleep(1);
+    // wall time, clock() would only see the CPU time of the syscall
+    BENCH("usleep 100") {
+        usleep(100);
     }
+
+    BENCH("memcpy 4k") {
+        memcpy(dst, src, sizeof(dst));
+        bench_clobber();
+    }
+
+    BENCH("sin") {
+        bench_do_not_optimize(x);
+        double y = sin(x);
+        bench_do_not_optimize(y);
+    }
+
+    return bench_exit();
 }
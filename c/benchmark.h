@@ -0,0 +1,637 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define BENCH_PERF 1
+#else
+#define BENCH_PERF 0
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "../asm/cpuid.h"
+#define BENCH_X86 1
+#else
+#define BENCH_X86 0
+#endif
+
+/**
+ * Micro-benchmark harness
+ *
+ *   BENCH("memcpy 4k") {
+ *       memcpy(dst, src, 4096);
+ *       bench_clobber();
+ *   }
+ *
+ * The body is run in batches timed with CLOCK_MONOTONIC_RAW and rdtscp. The
+ * batch size is first doubled until a batch takes bench_config.sample_ns,
+ * batches then run for bench_config.warmup_ns without being recorded, and
+ * finally every batch is a sample until there are max_samples of them or
+ * max_time_ns has passed (but at least min_samples). Per-op min, median, p99,
+ * mean and stddev are printed, kept for bench_write_json() and available in
+ * bench_last.
+ *
+ * Every iteration costs a decrement and a branch on top of the body, keep
+ * bodies well above a nanosecond or loop inside them.
+ *
+ * With bench_config.perf (-p) the measured batches are also counted with a
+ * perf_event_open group (cycles, instructions, cache and branch misses, user
+ * space only) to report IPC and misses per op. Counters the kernel or the CPU
+ * refuse (perf_event_paranoid, VMs without a PMU) are left out with a warning.
+ *
+ * bench_exit() can print every result as a table, compared to the medians of
+ * an earlier bench_write_json() file (-c): a benchmark slower than its
+ * baseline by more than bench_config.max_slowdown makes it return 1.
+ */
+
+#define BENCH_MAX_SAMPLES 1000
+#define BENCH_MAX_RESULTS 256
+#define BENCH_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+enum BenchCounter {
+    BENCH_CYCLES,
+    BENCH_INSTRUCTIONS,
+    BENCH_CACHE_MISSES,
+    BENCH_BRANCH_MISSES,
+    BENCH_NB_COUNTERS,
+};
+
+typedef struct BenchConfig {
+    int64_t sample_ns; // target duration of a batch
+    int64_t warmup_ns;
+    int64_t max_time_ns; // of the measurement, warmup not included
+    int min_samples;
+    int max_samples;
+    const char *filter; // only run benchmarks whose name contains this
+    int quiet;
+    int perf; // count hardware events
+    int table; // print a summary table at bench_exit()
+    const char *baseline; // JSON results to compare against
+    double max_slowdown; // fraction of the baseline median
+} BenchConfig;
+
+typedef struct BenchResult {
+    char name[64];
+    int64_t iters; // per sample
+    int nb_samples;
+    double min_ns, median_ns, p99_ns, mean_ns, stddev_ns; // per op
+    double median_ticks; // TSC ticks per op, 0 without a TSC
+    double counters[BENCH_NB_COUNTERS]; // per op over all samples, -1 when not counted
+    double ipc; // 0 unless both cycles and instructions were counted
+} BenchResult;
+
+enum BenchPhase {
+    BENCH_START,
+    BENCH_CALIBRATE,
+    BENCH_WARMUP,
+    BENCH_MEASURE,
+    BENCH_DONE,
+};
+
+typedef struct Bench {
+    const char *name;
+    enum BenchPhase phase;
+    int64_t iters;
+    int64_t left;
+    int64_t batch_start_ns;
+    uint64_t batch_start_ticks;
+    int64_t phase_start_ns;
+    int nb_samples;
+    double sample_ns[BENCH_MAX_SAMPLES];
+    double sample_ticks[BENCH_MAX_SAMPLES];
+    uint64_t counters_start[BENCH_NB_COUNTERS];
+    uint64_t counters[BENCH_NB_COUNTERS]; // summed over the measured batches
+} Bench;
+
+static BenchConfig bench_config = {
+    .sample_ns = 1000000,
+    .warmup_ns = 100000000,
+    .max_time_ns = 1000000000,
+    .min_samples = 10,
+    .max_samples = 100,
+    .max_slowdown = 0.10,
+};
+
+static BenchResult bench_results[BENCH_MAX_RESULTS];
+static int bench_nb_results;
+static BenchResult bench_last;
+static const char *bench_json_file;
+
+typedef struct BenchBaseline {
+    char name[64];
+    double median_ns;
+} BenchBaseline;
+
+static BenchBaseline bench_baseline[BENCH_MAX_RESULTS];
+static int bench_nb_baseline;
+
+/**
+ * Keep the compiler from optimizing away the computation of x
+ */
+#define bench_do_not_optimize(x) __asm__ volatile("" : : "r,m"(x) : "memory")
+
+/**
+ * Make the compiler assume all memory was read and written, so stores to buffers aren't dropped
+ */
+static inline void bench_clobber(void)
+{
+    __asm__ volatile("" : : : "memory");
+}
+
+static inline int64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline int bench_has_rdtscp(void)
+{
+#if BENCH_X86
+    static int has_rdtscp = -1;
+    if (has_rdtscp < 0) {
+        unsigned eax = 0x80000000, ebx, ecx = 0, edx;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        has_rdtscp = 0;
+        if (eax >= 0x80000001) {
+            eax = 0x80000001;
+            ecx = 0;
+            cpuid(&eax, &ebx, &ecx, &edx);
+            has_rdtscp = !!(edx & (1 << 27));
+        }
+    }
+    return has_rdtscp;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * TSC ticks (constant rate, not core cycles), 0 if the CPU can't tell
+ * rdtscp waits for the previous instructions to complete, unlike rdtsc
+ */
+static inline uint64_t bench_ticks(void)
+{
+#if BENCH_X86
+    if (bench_has_rdtscp()) {
+        unsigned lo, hi, aux;
+        __asm__ volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+        return ((uint64_t)hi << 32) | lo;
+    }
+#endif
+    return 0;
+}
+
+static const char *const bench_counter_names[BENCH_NB_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses",
+};
+
+// group leader first, -1 for counters that couldn't be opened
+static int bench_perf_fd[BENCH_NB_COUNTERS] = { -1, -1, -1, -1 };
+static uint64_t bench_perf_id[BENCH_NB_COUNTERS];
+static int bench_perf_state; // 0 not tried yet, 1 open, -1 unavailable
+
+/**
+ * Open the counter group once, returns 0 if at least one counter is there
+ */
+static inline int bench_perf_open(void)
+{
+#if BENCH_PERF
+    static const uint64_t configs[BENCH_NB_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    int leader = -1;
+
+    if (bench_perf_state)
+        return bench_perf_state > 0 ? 0 : -1;
+
+    for (int i = 0; i < BENCH_NB_COUNTERS; ++i) {
+        struct perf_event_attr attr = { 0 };
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // allowed with perf_event_paranoid <= 2, the default
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.disabled = leader < 0;
+
+        bench_perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (bench_perf_fd[i] < 0) {
+            fprintf(stderr, "BENCH: can't count %s: %s\n", bench_counter_names[i], strerror(errno));
+            continue;
+        }
+        ioctl(bench_perf_fd[i], PERF_EVENT_IOC_ID, &bench_perf_id[i]);
+        if (leader < 0)
+            leader = bench_perf_fd[i];
+    }
+
+    if (leader < 0) {
+        bench_perf_state = -1;
+        return -1;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    bench_perf_state = 1;
+    return 0;
+#else
+    fprintf(stderr, "BENCH: hardware counters are only supported on Linux\n");
+    bench_perf_state = -1;
+    return -1;
+#endif
+}
+
+/**
+ * Read the current value of every counter, scaled up if the group was multiplexed
+ */
+static inline void bench_perf_read(uint64_t *counters)
+{
+#if BENCH_PERF
+    // nr, time_enabled, time_running, then a value and id per counter
+    uint64_t buf[3 + 2 * BENCH_NB_COUNTERS];
+    int leader = -1;
+
+    for (int i = 0; i < BENCH_NB_COUNTERS && leader < 0; ++i)
+        leader = bench_perf_fd[i];
+    if (read(leader, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(*buf)))
+        return;
+
+    for (uint64_t n = 0; n < buf[0]; ++n) {
+        uint64_t value = buf[3 + 2 * n], id = buf[4 + 2 * n];
+        if (buf[2] && buf[2] < buf[1])
+            value = (double)value * buf[1] / buf[2];
+        for (int i = 0; i < BENCH_NB_COUNTERS; ++i)
+            if (bench_perf_fd[i] >= 0 && bench_perf_id[i] == id)
+                counters[i] = value;
+    }
+#else
+    (void)counters;
+#endif
+}
+
+static inline int bench_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Nearest-rank quantile of sorted values
+ */
+static inline double bench_quantile(const double *sorted, int n, double q)
+{
+    int rank = (int)ceil(q * n);
+    return sorted[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+}
+
+static inline void bench_finish(Bench *b)
+{
+    BenchResult *r = &bench_last;
+    double sorted[BENCH_MAX_SAMPLES];
+    int n = b->nb_samples;
+
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", b->name);
+    r->iters = b->iters;
+    r->nb_samples = n;
+
+    for (int i = 0; i < n; ++i)
+        sorted[i] = b->sample_ns[i] / b->iters;
+    qsort(sorted, n, sizeof(*sorted), bench_cmp_double);
+    r->min_ns = sorted[0];
+    r->median_ns = bench_quantile(sorted, n, 0.5);
+    r->p99_ns = bench_quantile(sorted, n, 0.99);
+    for (int i = 0; i < n; ++i)
+        r->mean_ns += sorted[i] / n;
+    for (int i = 0; i < n; ++i)
+        r->stddev_ns += (sorted[i] - r->mean_ns) * (sorted[i] - r->mean_ns);
+    r->stddev_ns = n > 1 ? sqrt(r->stddev_ns / (n - 1)) : 0;
+
+    for (int i = 0; i < n; ++i)
+        sorted[i] = b->sample_ticks[i] / b->iters;
+    qsort(sorted, n, sizeof(*sorted), bench_cmp_double);
+    r->median_ticks = bench_quantile(sorted, n, 0.5);
+
+    for (int i = 0; i < BENCH_NB_COUNTERS; ++i)
+        r->counters[i] = bench_perf_state > 0 && bench_perf_fd[i] >= 0 ?
+                         (double)b->counters[i] / ((double)n * b->iters) : -1;
+    if (r->counters[BENCH_CYCLES] > 0 && r->counters[BENCH_INSTRUCTIONS] >= 0)
+        r->ipc = r->counters[BENCH_INSTRUCTIONS] / r->counters[BENCH_CYCLES];
+
+    if (bench_nb_results < BENCH_MAX_RESULTS)
+        bench_results[bench_nb_results++] = *r;
+
+    if (!bench_config.quiet)
+        printf("BENCH: %-32s %12.2f ns/op (min %.2f, p99 %.2f, stddev %.2f) %10.1f ticks/op, %d x %"PRId64"\n",
+               r->name, r->median_ns, r->min_ns, r->p99_ns, r->stddev_ns, r->median_ticks,
+               r->nb_samples, r->iters);
+    if (!bench_config.quiet && bench_perf_state > 0) {
+        printf("       %-32s", "");
+        for (int i = 0; i < BENCH_NB_COUNTERS; ++i)
+            if (r->counters[i] >= 0)
+                printf(" %.2f %s/op", r->counters[i], bench_counter_names[i]);
+        if (r->ipc)
+            printf(", IPC %.2f", r->ipc);
+        printf("\n");
+    }
+}
+
+static inline void bench_start_batch(Bench *b)
+{
+    // outside the timed part, the read is a syscall
+    if (b->phase == BENCH_MEASURE && bench_perf_state > 0)
+        bench_perf_read(b->counters_start);
+    b->left = b->iters;
+    b->batch_start_ticks = bench_ticks();
+    b->batch_start_ns = bench_now_ns();
+}
+
+/**
+ * Called when a batch is over, decides what the next one is for
+ * Returns 0 once the benchmark is complete
+ */
+static inline int bench_batch_done(Bench *b)
+{
+    int64_t end_ns = bench_now_ns();
+    uint64_t end_ticks = bench_ticks();
+    int64_t elapsed = end_ns - b->batch_start_ns;
+
+    switch (b->phase) {
+    case BENCH_START:
+        b->phase = BENCH_CALIBRATE;
+        b->iters = 1;
+        break;
+    case BENCH_CALIBRATE:
+        if (elapsed < bench_config.sample_ns) {
+            // jump close to the target once the batch is long enough to be timed reliably
+            if (elapsed > 10000)
+                b->iters = b->iters * bench_config.sample_ns / elapsed + 1;
+            else
+                b->iters *= 2;
+            break;
+        }
+        b->phase = BENCH_WARMUP;
+        b->phase_start_ns = end_ns;
+        break;
+    case BENCH_WARMUP:
+        if (end_ns - b->phase_start_ns < bench_config.warmup_ns)
+            break;
+        b->phase = BENCH_MEASURE;
+        b->phase_start_ns = end_ns;
+        b->nb_samples = 0;
+        break;
+    case BENCH_MEASURE:
+        b->sample_ns[b->nb_samples] = elapsed;
+        b->sample_ticks[b->nb_samples] = end_ticks - b->batch_start_ticks;
+        if (bench_perf_state > 0) {
+            uint64_t counters[BENCH_NB_COUNTERS];
+            memcpy(counters, b->counters_start, sizeof(counters));
+            bench_perf_read(counters);
+            for (int i = 0; i < BENCH_NB_COUNTERS; ++i)
+                b->counters[i] += counters[i] - b->counters_start[i];
+        }
+        ++b->nb_samples;
+        if (b->nb_samples >= BENCH_MIN(bench_config.max_samples, BENCH_MAX_SAMPLES) ||
+            (b->nb_samples >= bench_config.min_samples && end_ns - b->phase_start_ns >= bench_config.max_time_ns)) {
+            b->phase = BENCH_DONE;
+            bench_finish(b);
+            return 0;
+        }
+        break;
+    case BENCH_DONE:
+        return 0;
+    }
+
+    bench_start_batch(b);
+    return 1;
+}
+
+static inline int bench_next(Bench *b)
+{
+    if (--b->left > 0)
+        return 1;
+    return bench_batch_done(b);
+}
+
+static inline Bench *bench_begin(Bench *b, const char *name)
+{
+    b->name = name;
+    b->phase = BENCH_START;
+    b->iters = 1;
+    b->left = 1;
+    b->nb_samples = 0;
+    memset(b->counters, 0, sizeof(b->counters));
+    if (bench_config.perf)
+        bench_perf_open();
+    if (bench_config.filter && !strstr(name, bench_config.filter))
+        b->phase = BENCH_DONE;
+    return b;
+}
+
+/**
+ * Run the following statement (or block) as a benchmark, _bench is its state
+ */
+#define BENCH(_name) \
+    for (Bench _bench_state, *_bench = bench_begin(&_bench_state, _name); bench_next(_bench); )
+
+static inline void bench_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/**
+ * Write every result so far as JSON, one benchmark per line so two runs diff cleanly
+ */
+static inline int bench_write_json(const char *filename)
+{
+    char host[256] = "";
+    char date[32] = "";
+    time_t now = time(NULL);
+    FILE *f = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "Can't open '%s'\n", filename);
+        return -1;
+    }
+
+    gethostname(host, sizeof(host) - 1);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    fprintf(f, "{\n  \"context\": {\"host\": ");
+    bench_json_string(f, host);
+    fprintf(f, ", \"date\": \"%s\", \"sample_ns\": %"PRId64", \"warmup_ns\": %"PRId64", \"tsc\": %s},\n"
+            "  \"benchmarks\": [\n", date, bench_config.sample_ns, bench_config.warmup_ns,
+            bench_has_rdtscp() ? "true" : "false");
+    for (int i = 0; i < bench_nb_results; ++i) {
+        const BenchResult *r = &bench_results[i];
+        fprintf(f, "    {\"name\": ");
+        bench_json_string(f, r->name);
+        fprintf(f, ", \"iterations\": %"PRId64", \"samples\": %d, \"min_ns\": %.3f, \"median_ns\": %.3f, "
+                "\"p99_ns\": %.3f, \"mean_ns\": %.3f, \"stddev_ns\": %.3f, \"median_ticks\": %.1f",
+                r->iters, r->nb_samples, r->min_ns, r->median_ns, r->p99_ns, r->mean_ns, r->stddev_ns,
+                r->median_ticks);
+        for (int c = 0; c < BENCH_NB_COUNTERS; ++c)
+            if (r->counters[c] >= 0)
+                fprintf(f, ", \"%s_per_op\": %.3f", bench_counter_names[c], r->counters[c]);
+        if (r->ipc)
+            fprintf(f, ", \"ipc\": %.3f", r->ipc);
+        fprintf(f, "}%s\n", i + 1 < bench_nb_results ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    if (f != stdout)
+        fclose(f);
+    return 0;
+}
+
+/**
+ * Read the medians of a bench_write_json() file, relies on its one benchmark per line layout
+ */
+static inline int bench_load_baseline(const char *filename)
+{
+    char line[1024];
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open '%s'\n", filename);
+        return -1;
+    }
+
+    bench_nb_baseline = 0;
+    while (fgets(line, sizeof(line), f) && bench_nb_baseline < BENCH_MAX_RESULTS) {
+        BenchBaseline *b = &bench_baseline[bench_nb_baseline];
+        const char *name = strstr(line, "\"name\": \"");
+        const char *median = strstr(line, "\"median_ns\": ");
+        if (!name || !median)
+            continue;
+        name += strlen("\"name\": \"");
+        int len = strcspn(name, "\"");
+        snprintf(b->name, sizeof(b->name), "%.*s", len, name);
+        b->median_ns = strtod(median + strlen("\"median_ns\": "), NULL);
+        ++bench_nb_baseline;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/**
+ * One line per result with the change from the baseline if there is one
+ * Returns the number of regressions
+ */
+static inline int bench_print_table(void)
+{
+    int nb_regressions = 0;
+
+    printf("\n%-40s %12s %12s %8s", "benchmark", "median ns", "p99 ns", "stddev");
+    if (bench_nb_baseline)
+        printf(" %12s %8s", "baseline", "change");
+    printf("\n");
+
+    for (int i = 0; i < bench_nb_results; ++i) {
+        const BenchResult *r = &bench_results[i];
+        printf("%-40s %12.2f %12.2f %7.1f%%", r->name, r->median_ns, r->p99_ns,
+               r->median_ns > 0 ? r->stddev_ns * 100 / r->median_ns : 0.0);
+
+        const BenchBaseline *b = NULL;
+        for (int j = 0; j < bench_nb_baseline && !b; ++j)
+            if (!strcmp(bench_baseline[j].name, r->name))
+                b = &bench_baseline[j];
+        if (b && b->median_ns > 0) {
+            double change = r->median_ns / b->median_ns - 1;
+            int regression = change > bench_config.max_slowdown;
+            nb_regressions += regression;
+            printf(" %12.2f %+7.1f%%%s", b->median_ns, change * 100, regression ? " REGRESSION" : "");
+        } else if (bench_nb_baseline) {
+            printf(" %12s %8s", "-", "new");
+        }
+        printf("\n");
+    }
+
+    return nb_regressions;
+}
+
+/**
+ * Handle the common options, returns the index of the first argument left or -1 on error
+ *   -j file   write the results as JSON ("-" for stdout) at bench_exit()
+ *   -f text   only run benchmarks whose name contains text
+ *   -t ms     measurement time per benchmark
+ *   -q        don't print a line per benchmark
+ *   -p        count cycles, instructions, cache and branch misses
+ *   -c file   compare to the results of an earlier -j run at bench_exit()
+ */
+static inline int bench_parse_args(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "j:f:t:qpc:")) != -1) {
+        switch (opt) {
+        case 'j':
+            bench_json_file = optarg;
+            break;
+        case 'f':
+            bench_config.filter = optarg;
+            break;
+        case 't':
+            bench_config.max_time_ns = atoll(optarg) * 1000000;
+            break;
+        case 'q':
+            bench_config.quiet = 1;
+            break;
+        case 'p':
+            bench_config.perf = 1;
+            break;
+        case 'c':
+            bench_config.baseline = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j results.json] [-f filter] [-t ms] [-q] [-p] [-c baseline.json]\n", argv[0]);
+            return -1;
+        }
+    }
+    return optind;
+}
+
+/**
+ * Write the JSON file, print the table and compare, returns the exit code of the program
+ */
+static inline int bench_exit(void)
+{
+    int ret = 0;
+
+    if (bench_json_file && bench_write_json(bench_json_file) < 0)
+        ret = 1;
+    if (bench_config.baseline && bench_load_baseline(bench_config.baseline) < 0)
+        ret = 1;
+    if (bench_config.table || bench_nb_baseline) {
+        int nb_regressions = bench_print_table();
+        if (nb_regressions) {
+            printf("%d benchmark(s) more than %.0f%% slower than the baseline\n",
+                   nb_regressions, bench_config.max_slowdown * 100);
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+#endif // BENCHMARK_H
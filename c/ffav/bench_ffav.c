@@ -0,0 +1,416 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../benchmark.h"
+#include "filter_stats.h"
+#include "frame_gen.h"
+#include "frame_pool.h"
+#include "tone_gen.h"
+#include "yuv_sink.h"
+
+/**
+ * Benchmarks of the ffav hot paths
+ *
+ * Everything runs on synthetic frames and the YUV writer goes to /dev/null, so
+ * results only depend on the machine and the libraries. The options are those
+ * of bench_parse_args(), a regression check before deploying is
+ *
+ *   bench_ffav -j before.json       (on the known good build)
+ *   bench_ffav -c before.json       (exits with 1 if anything got slower)
+ *
+ * The frame and sample generators are the tools' own, from frame_gen.h and
+ * tone_gen.h, save_yuv_frame() is yuv_sink_write() in all the tools.
+ */
+
+#define OVERLAY_FILTERSPEC "[in1] scale=iw/4:ih/4 [mid1]; [in2] [mid1] overlay=main_w-overlay_w-10:main_h-overlay_h-10:shortest=1 [out1]"
+#define OVERLAY_WIDTH 1280
+#define OVERLAY_HEIGHT 720
+
+typedef struct Resolution {
+    const char *name;
+    int width;
+    int height;
+} Resolution;
+
+static const Resolution resolutions[] = {
+    { "240p", 320, 240 },
+    { "360p", 640, 360 },
+    { "720p", 1280, 720 },
+    { "768p", 1366, 768 }, // linesize padded, rows are written one by one
+    { "1080p", 1920, 1080 },
+    { "2160p", 3840, 2160 },
+};
+
+#define NB_RESOLUTIONS ((int)(sizeof(resolutions) / sizeof(resolutions[0])))
+
+static AVFrame *alloc_video_frame(enum AVPixelFormat format, int width, int height)
+{
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return NULL;
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+static int get_dummy_frame(FramePool *pool, AVFrame *frame, int width, int height, int frame_index, int value)
+{
+    int ret = frame_pool_get(pool, frame, AV_PIX_FMT_YUV420P, width, height);
+    if (ret < 0)
+        return ret;
+
+    frame_gen_fill_overlay(frame->data, frame->linesize, width, height, frame_index, value);
+    return 0;
+}
+
+/**
+ * Every ramp kernel the CPU has, at every resolution
+ */
+static int bench_fill_yuv_frame(void)
+{
+    static const struct {
+        const char *name;
+        int flag;
+    } kernels[] = { { "c", 0 }, { "sse2", FRAME_GEN_SSE2 }, { "avx2", FRAME_GEN_AVX2 } };
+    int cpu_flags = frame_gen_cpu_flags();
+    char name[64];
+
+    for (int r = 0; r < NB_RESOLUTIONS; ++r) {
+        AVFrame *frame = alloc_video_frame(AV_PIX_FMT_YUV420P, resolutions[r].width, resolutions[r].height);
+        if (!frame)
+            return AVERROR(ENOMEM);
+
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+            if (kernels[k].flag && !(cpu_flags & kernels[k].flag))
+                continue;
+            frame_gen_init(kernels[k].flag);
+            snprintf(name, sizeof(name), "fill_yuv_frame %s %s", resolutions[r].name, kernels[k].name);
+            int i = 0;
+            BENCH(name) {
+                frame_gen_fill_yuv(frame->data, frame->linesize, frame->width, frame->height, i++);
+                bench_clobber();
+            }
+        }
+        av_frame_free(&frame);
+    }
+
+    frame_gen_init(-1);
+    return 0;
+}
+
+/**
+ * Pool round trip and pattern, the frame is released right away like a graph would
+ */
+static int bench_get_dummy_frame(void)
+{
+    FramePool pool = { 0 };
+    AVFrame *frame = av_frame_alloc();
+    int ret = 0;
+    char name[64];
+    if (!frame)
+        return AVERROR(ENOMEM);
+
+    for (int r = 0; r < NB_RESOLUTIONS && ret >= 0; ++r) {
+        snprintf(name, sizeof(name), "get_dummy_frame %s", resolutions[r].name);
+        int i = 0;
+        BENCH(name) {
+            if ((ret = get_dummy_frame(&pool, frame, resolutions[r].width, resolutions[r].height, i++, 1)) < 0)
+                break;
+            av_frame_unref(frame);
+        }
+    }
+
+    av_frame_free(&frame);
+    frame_pool_uninit(&pool);
+    return ret;
+}
+
+static int bench_save_yuv_frame(void)
+{
+    YuvSink sink;
+    FramePool pool = { 0 };
+    AVFrame *frame = av_frame_alloc();
+    int ret = 0;
+    char name[64];
+    if (!frame)
+        return AVERROR(ENOMEM);
+
+    // buffered, O_DIRECT would only measure the disk
+    if ((ret = yuv_sink_open(&sink, "/dev/null", 0)) < 0)
+        goto end;
+
+    for (int r = 0; r < NB_RESOLUTIONS && ret >= 0; ++r) {
+        if ((ret = get_dummy_frame(&pool, frame, resolutions[r].width, resolutions[r].height, 0, 1)) < 0)
+            break;
+        snprintf(name, sizeof(name), "save_yuv_frame %s", resolutions[r].name);
+        BENCH(name) {
+            if ((ret = yuv_sink_write(&sink, frame)) < 0)
+                break;
+        }
+        av_frame_unref(frame);
+    }
+
+    yuv_sink_close(&sink);
+end:
+    if (ret < 0)
+        printf("Failed to write frame: %s\n", av_err2str(ret));
+    av_frame_free(&frame);
+    frame_pool_uninit(&pool);
+    return ret;
+}
+
+static int bench_fill_samples(void)
+{
+    static const enum AVSampleFormat formats[] = {
+        AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP,
+    };
+    static const int channels[] = { 2, 6 };
+    ToneGen tone;
+    int ret = 0;
+    char name[64];
+
+    tone_gen_init(&tone, 440, 44100, 0.5);
+    for (size_t c = 0; c < sizeof(channels) / sizeof(channels[0]) && ret >= 0; ++c) {
+        for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]) && ret >= 0; ++f) {
+            AVFrame *frame = av_frame_alloc();
+            if (!frame)
+                return AVERROR(ENOMEM);
+            frame->format = formats[f];
+            frame->channel_layout = av_get_default_channel_layout(channels[c]);
+            frame->channels = channels[c];
+            frame->nb_samples = 1024;
+            frame->sample_rate = 44100;
+            if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+                av_frame_free(&frame);
+                break;
+            }
+
+            snprintf(name, sizeof(name), "fill_samples 1024x%d %s", channels[c], av_get_sample_fmt_name(formats[f]));
+            BENCH(name) {
+                if ((ret = tone_gen_fill_frame(&tone, frame)) < 0)
+                    break;
+                bench_clobber();
+            }
+            av_frame_free(&frame);
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Downscales between common resolutions and a same size format conversion, as scale_and_encode does
+ */
+static int bench_sws_scale(void)
+{
+    static const struct {
+        int src, dst; // in resolutions[]
+        enum AVPixelFormat dst_fmt;
+    } cases[] = {
+        { 4, 2, AV_PIX_FMT_YUV420P },
+        { 2, 1, AV_PIX_FMT_YUV420P },
+        { 5, 4, AV_PIX_FMT_YUV420P },
+        { 4, 4, AV_PIX_FMT_NV12 },
+        { 2, 2, AV_PIX_FMT_BGRA },
+    };
+    int ret = 0;
+    char name[64];
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]) && ret >= 0; ++i) {
+        const Resolution *src = &resolutions[cases[i].src];
+        const Resolution *dst = &resolutions[cases[i].dst];
+        AVFrame *in = alloc_video_frame(AV_PIX_FMT_YUV420P, src->width, src->height);
+        AVFrame *out = alloc_video_frame(cases[i].dst_fmt, dst->width, dst->height);
+        struct SwsContext *sws = sws_getContext(src->width, src->height, AV_PIX_FMT_YUV420P,
+                                                dst->width, dst->height, cases[i].dst_fmt,
+                                                SWS_BILINEAR, NULL, NULL, NULL);
+        if (!in || !out || !sws) {
+            ret = AVERROR(ENOMEM);
+        } else {
+            frame_gen_fill_yuv(in->data, in->linesize, in->width, in->height, 0);
+            snprintf(name, sizeof(name), "sws_scale %s->%s %s", src->name, dst->name,
+                     av_get_pix_fmt_name(cases[i].dst_fmt));
+            BENCH(name) {
+                sws_scale(sws, (const uint8_t * const *)in->data, in->linesize, 0, in->height,
+                          out->data, out->linesize);
+                bench_clobber();
+            }
+        }
+        sws_freeContext(sws);
+        av_frame_free(&in);
+        av_frame_free(&out);
+    }
+
+    return ret;
+}
+
+typedef struct OverlayGraph {
+    AVFilterGraph *graph;
+    AVFilterContext *inputs[2];
+    int nb_inputs;
+    AVFilterContext *output;
+    FramePool pool;
+    AVFrame *frame;
+    int64_t nb_frames_out;
+    FilterStats stats;
+    int instrumented;
+} OverlayGraph;
+
+static void overlay_graph_free(OverlayGraph *og)
+{
+    if (og->instrumented)
+        filter_stats_uninit(&og->stats);
+    avfilter_graph_free(&og->graph);
+    av_frame_free(&og->frame);
+    frame_pool_uninit(&og->pool);
+}
+
+/**
+ * Same graph and inputs as overlay_filter, buffer sources on the open inputs and a sink on the output
+ * instrumented adds filter_stats.h, as overlay_filter always does
+ */
+static int overlay_graph_init(OverlayGraph *og, int nb_threads, int instrumented)
+{
+    AVFilterInOut *inputs = NULL, *outputs = NULL;
+    char args[256];
+    int ret = 0;
+
+    og->frame = av_frame_alloc();
+    og->graph = avfilter_graph_alloc();
+    if (!og->frame || !og->graph)
+        return AVERROR(ENOMEM);
+    og->graph->nb_threads = nb_threads;
+
+    if ((ret = avfilter_graph_parse2(og->graph, OVERLAY_FILTERSPEC, &inputs, &outputs)) < 0)
+        goto end;
+    if (!outputs || outputs->next) {
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/25:pixel_aspect=1/1",
+             OVERLAY_WIDTH, OVERLAY_HEIGHT, AV_PIX_FMT_YUV420P);
+    for (AVFilterInOut *in = inputs; in; in = in->next) {
+        AVFilterContext *src = NULL;
+        if (og->nb_inputs == 2) {
+            ret = AVERROR(EINVAL);
+            goto end;
+        }
+        if ((ret = avfilter_graph_create_filter(&src, avfilter_get_by_name("buffer"), in->name,
+                                                args, NULL, og->graph)) < 0 ||
+            (ret = avfilter_link(src, 0, in->filter_ctx, in->pad_idx)) < 0)
+            goto end;
+        og->inputs[og->nb_inputs++] = src;
+    }
+
+    if ((ret = avfilter_graph_create_filter(&og->output, avfilter_get_by_name("buffersink"), "out",
+                                            NULL, NULL, og->graph)) < 0 ||
+        (ret = avfilter_link(outputs->filter_ctx, outputs->pad_idx, og->output, 0)) < 0)
+        goto end;
+
+    if ((ret = avfilter_graph_config(og->graph, NULL)) >= 0 && instrumented &&
+        (ret = filter_stats_init(&og->stats, og->graph, 0)) >= 0)
+        og->instrumented = 1;
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret < 0)
+        printf("Failed to set up the overlay graph: %s\n", av_err2str(ret));
+    return ret;
+}
+
+/**
+ * Generate a frame for every input, push them and drain the sink
+ */
+static int overlay_graph_step(OverlayGraph *og, int frame_index)
+{
+    int ret = 0;
+
+    for (int i = 0; i < og->nb_inputs; ++i) {
+        if ((ret = get_dummy_frame(&og->pool, og->frame, OVERLAY_WIDTH, OVERLAY_HEIGHT, frame_index, i)) < 0)
+            return ret;
+        og->frame->pts = frame_index;
+        ret = og->instrumented ? filter_stats_add_frame(&og->stats, og->inputs[i], og->frame, 0) :
+                                 av_buffersrc_add_frame(og->inputs[i], og->frame);
+        av_frame_unref(og->frame);
+        if (ret < 0)
+            return ret;
+    }
+
+    while ((ret = og->instrumented ? filter_stats_get_frame(&og->stats, og->output, og->frame, 0) :
+                                     av_buffersink_get_frame(og->output, og->frame)) >= 0) {
+        ++og->nb_frames_out;
+        av_frame_unref(og->frame);
+    }
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+static int bench_overlay_graph(void)
+{
+    // the instrumented run against the plain one of the same thread count is the filter_stats.h overhead
+    static const struct { int threads, instrumented; } configs[] = { { 1, 0 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+    int ret = 0;
+    char name[64];
+
+    for (size_t t = 0; t < sizeof(configs) / sizeof(configs[0]) && ret >= 0; ++t) {
+        OverlayGraph og = { 0 };
+        int threads = configs[t].threads;
+        if ((ret = overlay_graph_init(&og, threads, configs[t].instrumented)) >= 0) {
+            const char *suffix = configs[t].instrumented ? ", instrumented" : "";
+            if (threads)
+                snprintf(name, sizeof(name), "overlay graph 720p %d thread%s%s", threads, threads > 1 ? "s" : "", suffix);
+            else
+                snprintf(name, sizeof(name), "overlay graph 720p auto threads%s", suffix);
+            int i = 0;
+            BENCH(name) {
+                if ((ret = overlay_graph_step(&og, i++)) < 0)
+                    break;
+            }
+            // the graph holds back a frame or so, anything less means it stalled
+            if (ret >= 0 && og.nb_frames_out < i - 2) {
+                printf("Overlay graph returned %"PRId64" frames for %d inputs\n", og.nb_frames_out, i);
+                ret = AVERROR_BUG;
+            }
+        }
+        overlay_graph_free(&og);
+    }
+
+    if (ret < 0)
+        printf("Overlay graph failed: %s\n", av_err2str(ret));
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+
+    bench_config.table = 1;
+    if (bench_parse_args(argc, argv) < 0)
+        return 1;
+
+    av_log_set_level(AV_LOG_ERROR);
+    frame_gen_init(-1);
+
+    if ((ret = bench_fill_yuv_frame()) < 0 ||
+        (ret = bench_get_dummy_frame()) < 0 ||
+        (ret = bench_save_yuv_frame()) < 0 ||
+        (ret = bench_fill_samples()) < 0 ||
+        (ret = bench_sws_scale()) < 0 ||
+        (ret = bench_overlay_graph()) < 0)
+        printf("Benchmark failed: %s\n", av_err2str(ret));
+
+    return bench_exit() || ret < 0;
+}
@@ -0,0 +1,434 @@
+#define _GNU_SOURCE // CPU_SET, pthread_setaffinity_np
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "latency_hist.h"
+
+/**
+ * Decode benchmark
+ *
+ * The video stream of the input is read into memory once, then decoded by
+ * every requested decoder at every thread count and threading mode, frames are
+ * dropped as soon as they come out. No process startup, demuxing or output
+ * in the timings, unlike timing whole ffmpeg runs.
+ *
+ * Each run is pinned to its own set of cores, the decoder threads inherit it.
+ * Latency is from sending a packet to getting its frame back, so it includes
+ * the frames frame threading keeps in flight.
+ *
+ * Options:
+ *  -d <list>   decoders, e.g. libvpx,vp8 (default: the default decoder of the stream)
+ *  -t <list>   thread counts (default 1,2,3,4)
+ *  -m <list>   threading modes for more than one thread, frame and/or slice (default frame,slice)
+ *  -c <cpus>   pin every run to these cpus, e.g. 0-3 or 0,2,4 (default: the first <threads> cpus)
+ *  -r <n>      decode the packets n times per run (default 1)
+ */
+
+#define MAX_RUNS_PARAMS 32
+
+typedef struct PacketList {
+    AVPacket **pkts;
+    int nb_pkts;
+    int64_t nb_bytes;
+    AVCodecParameters *par;
+    AVRational time_base;
+} PacketList;
+
+typedef struct DecodeRun {
+    AVCodec *dec;
+    int nb_threads;
+    int thread_type; // FF_THREAD_FRAME or FF_THREAD_SLICE, 0 for a single thread
+    cpu_set_t cpus;
+    int nb_repeats;
+
+    int active_thread_type; // what the decoder actually used
+    int64_t nb_frames;
+    int64_t wall_us;
+    double cpu_s; // user + sys of the whole process
+    int64_t *send_time; // per packet of the current pass
+    LatencyHist latency; // microseconds
+} DecodeRun;
+
+static int64_t cpu_time_us(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void free_packets(PacketList *pl)
+{
+    for (int i = 0; i < pl->nb_pkts; ++i)
+        av_packet_free(&pl->pkts[i]);
+    av_freep(&pl->pkts);
+    avcodec_parameters_free(&pl->par);
+    pl->nb_pkts = 0;
+}
+
+/**
+ * Read every packet of the best video stream
+ */
+static int load_packets(const char *filename, PacketList *pl)
+{
+    AVFormatContext *ifmt_ctx = NULL;
+    AVPacket *pkt = NULL;
+    int ret = 0;
+    int idx;
+
+    if ((ret = avformat_open_input(&ifmt_ctx, filename, NULL, NULL)) < 0) {
+        fprintf(stderr, "Failed to open input '%s': %s\n", filename, av_err2str(ret));
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
+        fprintf(stderr, "Could not find stream info\n");
+        goto end;
+    }
+    if ((ret = idx = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+        fprintf(stderr, "No video stream found\n");
+        goto end;
+    }
+
+    pl->par = avcodec_parameters_alloc();
+    if (!pl->par) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_copy(pl->par, ifmt_ctx->streams[idx]->codecpar)) < 0)
+        goto end;
+    pl->time_base = ifmt_ctx->streams[idx]->time_base;
+
+    if (!(pkt = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    while ((ret = av_read_frame(ifmt_ctx, pkt)) >= 0) {
+        if (pkt->stream_index != idx) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        AVPacket **pkts = av_realloc_array(pl->pkts, pl->nb_pkts + 1, sizeof(*pl->pkts));
+        if (!pkts) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        pl->pkts = pkts;
+        // the list keeps the packet, the data stays in memory for every run
+        pl->nb_bytes += pkt->size;
+        pl->pkts[pl->nb_pkts++] = pkt;
+        if (!(pkt = av_packet_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+
+    printf("%s: %s %dx%d %s, %d packets, %.2f MB\n", filename, avcodec_get_name(pl->par->codec_id),
+           pl->par->width, pl->par->height, av_get_pix_fmt_name(pl->par->format) ? av_get_pix_fmt_name(pl->par->format) : "?",
+           pl->nb_pkts, pl->nb_bytes / 1e6);
+
+end:
+    av_packet_free(&pkt);
+    avformat_close_input(&ifmt_ctx);
+    if (ret < 0)
+        free_packets(pl);
+    return ret;
+}
+
+static int receive_frames(DecodeRun *run, AVCodecContext *dec_ctx, AVFrame *frame, int nb_pkts)
+{
+    int ret = 0;
+    while ((ret = avcodec_receive_frame(dec_ctx, frame)) >= 0) {
+        int64_t index = frame->reordered_opaque;
+        if (index >= 0 && index < nb_pkts)
+            latency_hist_add(&run->latency, av_gettime_relative() - run->send_time[index]);
+        ++run->nb_frames;
+        av_frame_unref(frame);
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/**
+ * Decode every packet nb_repeats times on the cpus of the run
+ */
+static int decode_run(DecodeRun *run, const PacketList *pl)
+{
+    AVCodecContext *dec_ctx = NULL;
+    AVFrame *frame = NULL;
+    cpu_set_t saved_cpus;
+    int ret = 0;
+
+    // set before the decoder starts its threads so they inherit it
+    pthread_getaffinity_np(pthread_self(), sizeof(saved_cpus), &saved_cpus);
+    if ((ret = pthread_setaffinity_np(pthread_self(), sizeof(run->cpus), &run->cpus))) {
+        fprintf(stderr, "Failed to pin to cpus: %s\n", strerror(ret));
+        return AVERROR(ret);
+    }
+
+    latency_hist_reset(&run->latency);
+    run->send_time = av_malloc_array(pl->nb_pkts, sizeof(*run->send_time));
+    frame = av_frame_alloc();
+    dec_ctx = avcodec_alloc_context3(run->dec);
+    if (!run->send_time || !frame || !dec_ctx) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(dec_ctx, pl->par)) < 0)
+        goto end;
+    dec_ctx->pkt_timebase = pl->time_base;
+    dec_ctx->thread_count = run->nb_threads;
+    dec_ctx->thread_type = run->thread_type;
+    if ((ret = avcodec_open2(dec_ctx, run->dec, NULL)) < 0) {
+        fprintf(stderr, "Failed to open decoder %s: %s\n", run->dec->name, av_err2str(ret));
+        goto end;
+    }
+    run->active_thread_type = dec_ctx->active_thread_type;
+
+    int64_t cpu_start = cpu_time_us();
+    int64_t start = av_gettime_relative();
+    for (int r = 0; r < run->nb_repeats && ret >= 0; ++r) {
+        if (r)
+            avcodec_flush_buffers(dec_ctx);
+        for (int i = 0; i < pl->nb_pkts && ret >= 0; ++i) {
+            // comes back on the frame(s) decoded from this packet
+            dec_ctx->reordered_opaque = i;
+            run->send_time[i] = av_gettime_relative();
+            if ((ret = avcodec_send_packet(dec_ctx, pl->pkts[i])) < 0 && ret != AVERROR_INVALIDDATA) {
+                fprintf(stderr, "Error sending packet %d: %s\n", i, av_err2str(ret));
+                break;
+            }
+            ret = receive_frames(run, dec_ctx, frame, pl->nb_pkts);
+        }
+        if (ret >= 0 && (ret = avcodec_send_packet(dec_ctx, NULL)) >= 0)
+            ret = receive_frames(run, dec_ctx, frame, pl->nb_pkts);
+    }
+    run->wall_us = av_gettime_relative() - start;
+    run->cpu_s = (cpu_time_us() - cpu_start) / 1e6;
+
+    if (ret < 0)
+        fprintf(stderr, "Decoding with %s failed: %s\n", run->dec->name, av_err2str(ret));
+
+end:
+    avcodec_free_context(&dec_ctx);
+    av_frame_free(&frame);
+    av_freep(&run->send_time);
+    pthread_setaffinity_np(pthread_self(), sizeof(saved_cpus), &saved_cpus);
+    return ret;
+}
+
+static const char *thread_type_name(int thread_type)
+{
+    return thread_type == FF_THREAD_FRAME ? "frame" : thread_type == FF_THREAD_SLICE ? "slice" : "-";
+}
+
+static void print_run(const DecodeRun *run)
+{
+    double wall = run->wall_us / 1e6;
+    int nb_cpus = CPU_COUNT(&run->cpus);
+    double busy = wall > 0 ? run->cpu_s / wall : 0.0;
+
+    printf("%-16s %7d %-6s %8"PRId64" %9.1f %8.3f %8.3f %8.3f %7.2f %6.0f%%\n",
+           run->dec->name, run->nb_threads, thread_type_name(run->active_thread_type), run->nb_frames,
+           wall > 0 ? run->nb_frames / wall : 0.0,
+           latency_hist_quantile(&run->latency, 0.50) / 1000.0,
+           latency_hist_quantile(&run->latency, 0.99) / 1000.0,
+           run->latency.count ? run->latency.max / 1000.0 : 0.0,
+           busy, nb_cpus ? busy * 100 / nb_cpus : 0.0);
+}
+
+/**
+ * Comma separated positive integers
+ */
+static int parse_int_list(const char *str, int *values, int max_values)
+{
+    int n = 0;
+    char *end;
+    while (*str && n < max_values) {
+        long v = strtol(str, &end, 10);
+        if (end == str || v < 1 || (*end && *end != ','))
+            return -1;
+        values[n++] = v;
+        str = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+/**
+ * cpu list in the taskset/cgroup format, e.g. 0-3,8
+ */
+static int parse_cpus(const char *str, cpu_set_t *cpus)
+{
+    char *end;
+    CPU_ZERO(cpus);
+    while (*str) {
+        long first = strtol(str, &end, 10), last = first;
+        if (end == str || first < 0)
+            return -1;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first)
+                return -1;
+        }
+        if (*end && *end != ',')
+            return -1;
+        for (long c = first; c <= last && c < CPU_SETSIZE; ++c)
+            CPU_SET(c, cpus);
+        str = *end ? end + 1 : end;
+    }
+    return CPU_COUNT(cpus) ? 0 : -1;
+}
+
+/**
+ * The first n cpus this process may run on, fewer if there aren't that many
+ */
+static void first_cpus(const cpu_set_t *allowed, int n, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    for (int c = 0; c < CPU_SETSIZE && CPU_COUNT(cpus) < n; ++c)
+        if (CPU_ISSET(c, allowed))
+            CPU_SET(c, cpus);
+}
+
+static int usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d decoder,...] [-t threads,...] [-m frame,slice] [-c cpus] [-r repeats] <input_file>\n",
+            name);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    PacketList pl = { 0 };
+    const char *decoder_list = NULL;
+    int threads[MAX_RUNS_PARAMS] = { 1, 2, 3, 4 };
+    int nb_threads = 4;
+    int thread_types[2] = { FF_THREAD_FRAME, FF_THREAD_SLICE };
+    int nb_thread_types = 2;
+    const char *cpu_list = NULL;
+    int nb_repeats = 1;
+    cpu_set_t allowed, fixed_cpus;
+    AVCodec *decoders[MAX_RUNS_PARAMS];
+    int nb_decoders = 0;
+    int nb_failed = 0;
+    int ret = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:t:m:c:r:")) != -1) {
+        switch (opt) {
+        case 'd':
+            decoder_list = optarg;
+            break;
+        case 't':
+            if ((nb_threads = parse_int_list(optarg, threads, MAX_RUNS_PARAMS)) <= 0) {
+                fprintf(stderr, "Invalid thread counts '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            nb_thread_types = 0;
+            if (strstr(optarg, "frame"))
+                thread_types[nb_thread_types++] = FF_THREAD_FRAME;
+            if (strstr(optarg, "slice"))
+                thread_types[nb_thread_types++] = FF_THREAD_SLICE;
+            if (!nb_thread_types) {
+                fprintf(stderr, "Unknown threading mode '%s', expected frame and/or slice\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            cpu_list = optarg;
+            break;
+        case 'r':
+            nb_repeats = FFMAX(atoi(optarg), 1);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        return usage(argv[0]);
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    if (cpu_list && parse_cpus(cpu_list, &fixed_cpus) < 0) {
+        fprintf(stderr, "Invalid cpu list '%s'\n", cpu_list);
+        return 1;
+    }
+
+    if ((ret = load_packets(argv[optind], &pl)) < 0)
+        return 1;
+    if (!pl.nb_pkts) {
+        fprintf(stderr, "No packets to decode\n");
+        goto end;
+    }
+
+    if (decoder_list) {
+        char *list = av_strdup(decoder_list), *saveptr = NULL;
+        for (char *name = list ? strtok_r(list, ",", &saveptr) : NULL; name && nb_decoders < MAX_RUNS_PARAMS;
+             name = strtok_r(NULL, ",", &saveptr)) {
+            AVCodec *dec = avcodec_find_decoder_by_name(name);
+            if (!dec)
+                fprintf(stderr, "Decoder '%s' not found, skipped\n", name);
+            else if (dec->id != pl.par->codec_id)
+                fprintf(stderr, "Decoder '%s' can't decode %s, skipped\n", name, avcodec_get_name(pl.par->codec_id));
+            else
+                decoders[nb_decoders++] = dec;
+        }
+        av_free(list);
+    } else if ((decoders[0] = avcodec_find_decoder(pl.par->codec_id))) {
+        nb_decoders = 1;
+    }
+    if (!nb_decoders) {
+        fprintf(stderr, "No decoder to benchmark\n");
+        ret = AVERROR_DECODER_NOT_FOUND;
+        goto end;
+    }
+
+    printf("%-16s %7s %-6s %8s %9s %8s %8s %8s %7s %7s\n", "decoder", "threads", "mode", "frames", "fps",
+           "p50 ms", "p99 ms", "max ms", "cores", "util");
+    for (int d = 0; d < nb_decoders; ++d) {
+        for (int t = 0; t < nb_threads; ++t) {
+            // the mode means nothing with a single thread
+            for (int m = 0; m < (threads[t] > 1 ? nb_thread_types : 1); ++m) {
+                DecodeRun run = { 0 };
+                run.dec = decoders[d];
+                run.nb_threads = threads[t];
+                run.thread_type = threads[t] > 1 ? thread_types[m] : 0;
+                run.nb_repeats = nb_repeats;
+                if (cpu_list)
+                    run.cpus = fixed_cpus;
+                else
+                    first_cpus(&allowed, threads[t], &run.cpus);
+
+                int caps = run.thread_type == FF_THREAD_FRAME ? AV_CODEC_CAP_FRAME_THREADS :
+                           run.thread_type == FF_THREAD_SLICE ? AV_CODEC_CAP_SLICE_THREADS : 0;
+                if (caps && !(run.dec->capabilities & caps)) {
+                    printf("%-16s %7d %-6s not supported\n", run.dec->name, run.nb_threads,
+                           thread_type_name(run.thread_type));
+                    continue;
+                }
+
+                if (decode_run(&run, &pl) < 0) {
+                    ++nb_failed;
+                    continue;
+                }
+                print_run(&run);
+            }
+        }
+    }
+
+end:
+    free_packets(&pl);
+    return ret < 0 || nb_failed ? 1 : 0;
+}
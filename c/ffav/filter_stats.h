@@ -0,0 +1,191 @@
+#ifndef FILTER_STATS_H
+#define FILTER_STATS_H
+
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Filter graph instrumentation, through the public libavfilter API only
+ *
+ * The graph is measured at its ends: every av_buffersrc_add_frame_flags() and
+ * av_buffersink_get_frame_flags() call made through filter_stats_add_frame() /
+ * filter_stats_get_frame() is timed and its frames counted, per buffer source
+ * and sink. Without AV_BUFFERSRC_FLAG_PUSH a push only queues the frame and
+ * the filtering happens in the pulls, so the sink time is the graph's time.
+ * A call costs two clock reads more, noise next to filtering a video frame,
+ * bench_ffav has the overlay graph with and without.
+ *
+ * The graph must only be run from one thread at a time (it has to be anyway).
+ */
+
+typedef struct FilterEnd {
+    AVFilterContext *ctx;
+    int sink;
+    int64_t nb_calls;
+    int64_t nb_frames; // pushed, or returned by the sink
+    int64_t nb_again; // pulls that found nothing ready
+    int64_t time_ns;
+    // at the last periodic report
+    int64_t last_calls;
+    int64_t last_frames;
+    int64_t last_again;
+    int64_t last_time_ns;
+} FilterEnd;
+
+typedef struct FilterStats {
+    FilterEnd *ends;
+    int nb_ends;
+
+    int64_t report_interval_ns; // 0 for no periodic report
+    int64_t next_report_ns;
+    int64_t last_report_ns;
+} FilterStats;
+
+static inline int64_t filter_stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Set up the counters of every source and sink of a configured graph (after avfilter_graph_config())
+ * report_interval is in microseconds, 0 only reports when asked to
+ */
+static inline int filter_stats_init(FilterStats *fs, AVFilterGraph *graph, int64_t report_interval)
+{
+    memset(fs, 0, sizeof(*fs));
+
+    fs->ends = av_mallocz_array(FFMAX(graph->nb_filters, 1), sizeof(*fs->ends));
+    if (!fs->ends)
+        return AVERROR(ENOMEM);
+
+    for (unsigned i = 0; i < graph->nb_filters; ++i) {
+        AVFilterContext *ctx = graph->filters[i];
+        if (ctx->nb_inputs && ctx->nb_outputs)
+            continue;
+        FilterEnd *fe = &fs->ends[fs->nb_ends++];
+        fe->ctx = ctx;
+        fe->sink = !ctx->nb_outputs;
+    }
+
+    fs->report_interval_ns = report_interval * 1000;
+    fs->last_report_ns = filter_stats_now_ns();
+    fs->next_report_ns = fs->last_report_ns + fs->report_interval_ns;
+    return 0;
+}
+
+/**
+ * Must be called before the graph is freed, fine to call twice
+ */
+static inline void filter_stats_uninit(FilterStats *fs)
+{
+    av_freep(&fs->ends);
+    fs->nb_ends = 0;
+}
+
+static inline FilterEnd *filter_stats_end(FilterStats *fs, const AVFilterContext *ctx)
+{
+    for (int i = 0; i < fs->nb_ends; ++i)
+        if (fs->ends[i].ctx == ctx)
+            return &fs->ends[i];
+    return NULL;
+}
+
+/**
+ * Print the totals, or with interval set what happened since the previous interval report
+ */
+static inline void filter_stats_print(FilterStats *fs, const char *title, int interval)
+{
+    int64_t now = filter_stats_now_ns();
+    int64_t total_ns = 0;
+
+    for (int i = 0; i < fs->nb_ends; ++i)
+        total_ns += fs->ends[i].time_ns - (interval ? fs->ends[i].last_time_ns : 0);
+
+    printf("%s", title);
+    if (interval)
+        printf(" (last %.1f s)", (now - fs->last_report_ns) / 1e9);
+    printf(": %.3f ms in the buffer sources and sinks\n", total_ns / 1e6);
+    printf("  %-24s %-12s %10s %10s %10s %10s %10s %7s\n",
+           "filter", "type", "calls", "frames", "not ready", "time ms", "us/frame", "share");
+
+    for (int i = 0; i < fs->nb_ends; ++i) {
+        FilterEnd *fe = &fs->ends[i];
+        int64_t calls = fe->nb_calls - (interval ? fe->last_calls : 0);
+        int64_t frames = fe->nb_frames - (interval ? fe->last_frames : 0);
+        int64_t again = fe->nb_again - (interval ? fe->last_again : 0);
+        int64_t time_ns = fe->time_ns - (interval ? fe->last_time_ns : 0);
+
+        printf("  %-24s %-12s %10"PRId64" %10"PRId64" ", fe->ctx->name, fe->ctx->filter->name, calls, frames);
+        if (fe->sink)
+            printf("%10"PRId64" ", again);
+        else
+            printf("%10s ", "-");
+        printf("%10.3f %10.1f %6.1f%%\n", time_ns / 1e6, frames ? time_ns / 1e3 / frames : 0.0,
+               total_ns ? 100.0 * time_ns / total_ns : 0.0);
+
+        if (interval) {
+            fe->last_calls = fe->nb_calls;
+            fe->last_frames = fe->nb_frames;
+            fe->last_again = fe->nb_again;
+            fe->last_time_ns = fe->time_ns;
+        }
+    }
+
+    if (interval)
+        fs->last_report_ns = now;
+}
+
+/**
+ * av_buffersrc_add_frame_flags() timed, frame NULL signals EOF as usual
+ */
+static inline int filter_stats_add_frame(FilterStats *fs, AVFilterContext *src, AVFrame *frame, int flags)
+{
+    FilterEnd *fe = filter_stats_end(fs, src);
+    int64_t start = filter_stats_now_ns();
+    int ret = av_buffersrc_add_frame_flags(src, frame, flags);
+
+    if (fe) {
+        fe->time_ns += filter_stats_now_ns() - start;
+        ++fe->nb_calls;
+        fe->nb_frames += frame && ret >= 0;
+    }
+
+    return ret;
+}
+
+/**
+ * av_buffersink_get_frame_flags() timed
+ * Prints the periodic report when it's due
+ */
+static inline int filter_stats_get_frame(FilterStats *fs, AVFilterContext *sink, AVFrame *frame, int flags)
+{
+    FilterEnd *fe = filter_stats_end(fs, sink);
+    int64_t start = filter_stats_now_ns();
+    int ret = av_buffersink_get_frame_flags(sink, frame, flags);
+    int64_t end = filter_stats_now_ns();
+
+    if (fe) {
+        fe->time_ns += end - start;
+        ++fe->nb_calls;
+        fe->nb_frames += ret >= 0;
+        fe->nb_again += ret == AVERROR(EAGAIN);
+    }
+
+    if (fs->report_interval_ns && end >= fs->next_report_ns) {
+        filter_stats_print(fs, "Filter graph", 1);
+        fs->next_report_ns = end + fs->report_interval_ns;
+    }
+
+    return ret;
+}
+
+#endif // FILTER_STATS_H
@@ -0,0 +1,207 @@
+#ifndef FRAME_GEN_H
+#define FRAME_GEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include "../../asm/cpuid.h"
+#define FRAME_GEN_X86 1
+#else
+#define FRAME_GEN_X86 0
+#endif
+
+/**
+ * Synthetic frame generators
+ *
+ * Every test pattern used by the filter examples is an 8-bit plane of the form
+ *   data[y][x] = start + y * row_step + x * col_step (mod 256)
+ * so each row is a byte ramp. Rows are produced by a ramp kernel picked at
+ * runtime from the scalar, SSE2 and AVX2 versions, which all give bit-identical
+ * output (see frame_gen_check()).
+ */
+
+#define FRAME_GEN_SSE2 (1 << 0)
+#define FRAME_GEN_AVX2 (1 << 1)
+
+typedef void (*RampRowFunc)(uint8_t *dst, int width, uint8_t start, uint8_t step);
+
+static inline void ramp_row_c(uint8_t *dst, int width, uint8_t start, uint8_t step)
+{
+    uint8_t v = start;
+    for (int x = 0; x < width; ++x, v += step)
+        dst[x] = v;
+}
+
+#if FRAME_GEN_X86
+__attribute__((target("sse2")))
+static inline void ramp_row_sse2(uint8_t *dst, int width, uint8_t start, uint8_t step)
+{
+    uint8_t first[16];
+    int x = 0;
+
+    ramp_row_c(first, 16, start, step);
+    __m128i v = _mm_loadu_si128((const __m128i *)first);
+    __m128i inc = _mm_set1_epi8((char)(step * 16));
+    for (; x + 16 <= width; x += 16) {
+        _mm_storeu_si128((__m128i *)(dst + x), v);
+        v = _mm_add_epi8(v, inc);
+    }
+    ramp_row_c(dst + x, width - x, start + x * step, step);
+}
+
+__attribute__((target("avx2")))
+static inline void ramp_row_avx2(uint8_t *dst, int width, uint8_t start, uint8_t step)
+{
+    uint8_t first[32];
+    int x = 0;
+
+    ramp_row_c(first, 32, start, step);
+    __m256i v = _mm256_loadu_si256((const __m256i *)first);
+    __m256i inc = _mm256_set1_epi8((char)(step * 32));
+    for (; x + 32 <= width; x += 32) {
+        _mm256_storeu_si256((__m256i *)(dst + x), v);
+        v = _mm256_add_epi8(v, inc);
+    }
+    ramp_row_c(dst + x, width - x, start + x * step, step);
+}
+#endif
+
+static inline int frame_gen_cpu_flags(void)
+{
+    int flags = 0;
+#if FRAME_GEN_X86
+    unsigned eax = 0, ebx, ecx = 0, edx;
+    cpuid(&eax, &ebx, &ecx, &edx);
+    unsigned max_leaf = eax;
+
+    eax = 1;
+    ecx = 0;
+    cpuid(&eax, &ebx, &ecx, &edx);
+    if (edx & (1 << 26))
+        flags |= FRAME_GEN_SSE2;
+
+    // AVX2 also needs the OS to save the ymm registers (OSXSAVE + XCR0 bits 1 and 2)
+    if (max_leaf >= 7 && (ecx & (1 << 27)) && (ecx & (1 << 28))) {
+        unsigned xcr0_lo, xcr0_hi;
+        asm volatile("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        eax = 7;
+        ecx = 0;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        if ((xcr0_lo & 0x6) == 0x6 && (ebx & (1 << 5)))
+            flags |= FRAME_GEN_AVX2;
+    }
+#endif
+    return flags;
+}
+
+static inline RampRowFunc frame_gen_select(int cpu_flags)
+{
+#if FRAME_GEN_X86
+    if (cpu_flags & FRAME_GEN_AVX2)
+        return ramp_row_avx2;
+    if (cpu_flags & FRAME_GEN_SSE2)
+        return ramp_row_sse2;
+#endif
+    (void)cpu_flags;
+    return ramp_row_c;
+}
+
+static RampRowFunc frame_gen_ramp_row;
+
+/**
+ * Pick the ramp kernel, cpu_flags < 0 detects what the CPU supports
+ * Called implicitly by the first frame_gen_fill_plane(), call it explicitly
+ * before starting threads or to force a kernel
+ */
+static inline void frame_gen_init(int cpu_flags)
+{
+    frame_gen_ramp_row = frame_gen_select(cpu_flags < 0 ? frame_gen_cpu_flags() : cpu_flags);
+}
+
+static inline void frame_gen_fill_plane(uint8_t *data, int linesize, int width, int height,
+                                        int start, int row_step, int col_step)
+{
+    if (!frame_gen_ramp_row)
+        frame_gen_init(-1);
+
+    uint8_t row_start = start;
+    for (int y = 0; y < height; ++y, data += linesize, row_start += row_step)
+        frame_gen_ramp_row(data, width, row_start, col_step);
+}
+
+/**
+ * simple_video_filter's YUV420P test pattern
+ * Y = x + y + 3i, U = 128 + y + 2i, V = 64 + x + 5i
+ */
+static inline void frame_gen_fill_yuv(uint8_t *const data[], const int linesize[], int width, int height,
+                                      int frame_index)
+{
+    frame_gen_fill_plane(data[0], linesize[0], width, height, frame_index * 3, 1, 1);
+    frame_gen_fill_plane(data[1], linesize[1], width / 2, height / 2, 128 + frame_index * 2, 1, 0);
+    frame_gen_fill_plane(data[2], linesize[2], width / 2, height / 2, 64 + frame_index * 5, 0, 1);
+}
+
+/**
+ * overlay_filter's YUV420P input pattern, value tells the inputs apart
+ * Y = x + y + 3i, U = (128 + y + i) * 2v, V = (64 + x + i) * 5v
+ */
+static inline void frame_gen_fill_overlay(uint8_t *const data[], const int linesize[], int width, int height,
+                                          int frame_index, int value)
+{
+    frame_gen_fill_plane(data[0], linesize[0], width, height, frame_index * 3, 1, 1);
+    frame_gen_fill_plane(data[1], linesize[1], width / 2, height / 2,
+                         (128 + frame_index) * value * 2, value * 2, 0);
+    frame_gen_fill_plane(data[2], linesize[2], width / 2, height / 2,
+                         (64 + frame_index) * value * 5, 0, value * 5);
+}
+
+/**
+ * Compare every kernel the CPU supports against the scalar one
+ * Returns the number of mismatching rows
+ */
+static inline int frame_gen_check(void)
+{
+    static const int widths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 160, 319, 320, 640, 1279, 1280, 1920 };
+    static const int steps[] = { 0, 1, 2, 3, 5, 10, 127, 128, 255 };
+    uint8_t ref[1920 + 64], out[1920 + 64];
+    int cpu_flags = frame_gen_cpu_flags();
+    int nb_errors = 0;
+
+    struct {
+        const char *name;
+        int flag;
+    } kernels[] = { { "sse2", FRAME_GEN_SSE2 }, { "avx2", FRAME_GEN_AVX2 } };
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!(cpu_flags & kernels[k].flag)) {
+            printf("%s: not supported, skipped\n", kernels[k].name);
+            continue;
+        }
+        RampRowFunc fn = frame_gen_select(kernels[k].flag);
+        int nb_rows = 0;
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w) {
+            for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); ++s) {
+                for (int start = 0; start < 256; start += 37) {
+                    // guard bytes catch writes past the end of the row
+                    memset(ref, 0xAA, sizeof(ref));
+                    memset(out, 0xAA, sizeof(out));
+                    ramp_row_c(ref, widths[w], start, steps[s]);
+                    fn(out, widths[w], start, steps[s]);
+                    if (memcmp(ref, out, sizeof(ref))) {
+                        printf("%s: mismatch for width %d start %d step %d\n", kernels[k].name, widths[w], start, steps[s]);
+                        ++nb_errors;
+                    }
+                    ++nb_rows;
+                }
+            }
+        }
+        printf("%s: %d rows compared against scalar\n", kernels[k].name, nb_rows);
+    }
+
+    return nb_errors;
+}
+
+#endif // FRAME_GEN_H
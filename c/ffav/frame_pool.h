@@ -0,0 +1,120 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <libavutil/buffer.h>
+#include <libavutil/common.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+/**
+ * Refcounted video frame pool
+ *
+ * One AVBufferPool per plane, sized for a single format and resolution. A frame
+ * handed out by frame_pool_get() only holds references to pooled buffers, so once
+ * every consumer (e.g. a filter graph) has unreferenced it, the planes go back to
+ * the pool instead of being freed.
+ */
+
+#define FRAME_POOL_ALIGN 32
+
+typedef struct FramePool {
+    enum AVPixelFormat format;
+    int width;
+    int height;
+    int nb_planes;
+    int linesize[4];
+    AVBufferPool *pools[4];
+
+    // statistics, one request/allocation per plane buffer
+    int64_t nb_requests;
+    int64_t nb_allocs;
+} FramePool;
+
+static inline AVBufferRef *frame_pool_alloc(void *opaque, int size)
+{
+    FramePool *fp = opaque;
+    // called with the AVBufferPool lock held, only when no buffer can be recycled
+    ++fp->nb_allocs;
+    return av_buffer_alloc(size);
+}
+
+static inline void frame_pool_uninit(FramePool *fp)
+{
+    // pools are only freed once every outstanding buffer has been returned
+    for (int i = 0; i < 4; ++i)
+        av_buffer_pool_uninit(&fp->pools[i]);
+    fp->nb_planes = 0;
+}
+
+static inline int frame_pool_init(FramePool *fp, enum AVPixelFormat format, int width, int height)
+{
+    int ret = 0;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (!desc || desc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+        return AVERROR(EINVAL);
+
+    frame_pool_uninit(fp);
+    fp->format = format;
+    fp->width = width;
+    fp->height = height;
+
+    if ((ret = av_image_fill_linesizes(fp->linesize, format, FFALIGN(width, FRAME_POOL_ALIGN))) < 0)
+        return ret;
+    for (int i = 0; i < 4; ++i)
+        fp->linesize[i] = FFALIGN(fp->linesize[i], FRAME_POOL_ALIGN);
+
+    fp->nb_planes = av_pix_fmt_count_planes(format);
+    for (int i = 0; i < fp->nb_planes; ++i) {
+        int h = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+        // same padding as av_frame_get_buffer(), some SIMD code reads past the last line
+        int size = fp->linesize[i] * (h + 1) + 16 + FRAME_POOL_ALIGN - 1;
+        fp->pools[i] = av_buffer_pool_init2(size, fp, frame_pool_alloc, NULL);
+        if (!fp->pools[i]) {
+            frame_pool_uninit(fp);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Attach pooled buffers to frame, which must be blank (freshly allocated or unreferenced)
+ * The pool is reconfigured if format or size differ from the previous request
+ */
+static inline int frame_pool_get(FramePool *fp, AVFrame *frame, enum AVPixelFormat format, int width, int height)
+{
+    int ret = 0;
+    if (!fp->nb_planes || fp->format != format || fp->width != width || fp->height != height)
+        if ((ret = frame_pool_init(fp, format, width, height)) < 0)
+            return ret;
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+
+    for (int i = 0; i < fp->nb_planes; ++i) {
+        ++fp->nb_requests;
+        frame->buf[i] = av_buffer_pool_get(fp->pools[i]);
+        if (!frame->buf[i]) {
+            av_frame_unref(frame);
+            return AVERROR(ENOMEM);
+        }
+        frame->data[i] = (uint8_t *)FFALIGN((uintptr_t)frame->buf[i]->data, FRAME_POOL_ALIGN);
+        frame->linesize[i] = fp->linesize[i];
+    }
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+static inline void frame_pool_print_stats(const FramePool *fp, const char *name)
+{
+    printf("%s: %"PRId64" buffer requests, %"PRId64" allocations, %"PRId64" allocations avoided\n",
+           name, fp->nb_requests, fp->nb_allocs, fp->nb_requests - fp->nb_allocs);
+}
+
+#endif // FRAME_POOL_H
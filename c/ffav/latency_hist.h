@@ -0,0 +1,107 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Log-linear latency histogram
+ *
+ * Values (microseconds, or any other unit) below 16 get a bucket each, above
+ * that every power of two is split into 16 buckets, so a percentile is off by
+ * at most 1/16 (~6%) of its value whatever the range. Recording is a couple
+ * of instructions and never allocates, it's fine on the packet path.
+ */
+
+#define LATENCY_HIST_SUB_BITS 4
+#define LATENCY_HIST_SUB (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS ((64 - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB)
+
+typedef struct LatencyHist {
+    uint64_t counts[LATENCY_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} LatencyHist;
+
+static inline void latency_hist_reset(LatencyHist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int latency_hist_bucket(uint64_t v)
+{
+    if (v < LATENCY_HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - LATENCY_HIST_SUB_BITS;
+    return (shift + 1) * LATENCY_HIST_SUB + (int)((v >> shift) - LATENCY_HIST_SUB);
+}
+
+/**
+ * Smallest value falling into bucket b
+ */
+static inline uint64_t latency_hist_bucket_start(int b)
+{
+    if (b < LATENCY_HIST_SUB)
+        return b;
+    int shift = b / LATENCY_HIST_SUB - 1;
+    return (uint64_t)(LATENCY_HIST_SUB + b % LATENCY_HIST_SUB) << shift;
+}
+
+static inline void latency_hist_add(LatencyHist *h, int64_t v)
+{
+    // clock steps can make a latency come out negative, count it as 0
+    uint64_t u = v < 0 ? 0 : v;
+    ++h->counts[latency_hist_bucket(u)];
+    ++h->count;
+    h->sum += u;
+    if (u < h->min)
+        h->min = u;
+    if (u > h->max)
+        h->max = u;
+}
+
+/**
+ * Value below which a fraction q (0..1) of the samples fall, middle of the bucket, never above max
+ */
+static inline uint64_t latency_hist_quantile(const LatencyHist *h, double q)
+{
+    if (!h->count)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_HIST_BUCKETS; ++b) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t lo = latency_hist_bucket_start(b);
+            uint64_t hi = b + 1 < LATENCY_HIST_BUCKETS ? latency_hist_bucket_start(b + 1) : h->max + 1;
+            uint64_t mid = lo + (hi - lo) / 2;
+            return mid > h->max ? h->max : mid < h->min ? h->min : mid;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * One line summary, values are printed in milliseconds assuming microsecond samples
+ */
+static inline void latency_hist_print(const LatencyHist *h, const char *name)
+{
+    if (!h->count) {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    printf("%s: %"PRIu64" samples, min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           name, h->count, h->min / 1000.0, (double)h->sum / h->count / 1000.0,
+           latency_hist_quantile(h, 0.50) / 1000.0, latency_hist_quantile(h, 0.99) / 1000.0,
+           h->max / 1000.0);
+}
+
+#endif // LATENCY_HIST_H
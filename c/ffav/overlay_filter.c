@@ -1,24 +1,51 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/frame.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "filter_stats.h"
+#include "frame_gen.h"
+#include "frame_pool.h"
+#include "spsc_queue.h"
+#include "trace.h"
+#include "yuv_sink.h"
+#include "yuv_source.h"
+
 /**
  * Complex video filter example
  *
  * Downsizes first input and overlays it over the second input
+ *
+ * Options:
+ *  -i <file>       raw YUV420P file for the next graph input, others get synthetic frames
+ *  -s <WxH>        size of the -i files (default 1280x720)
+ *  -t <threads>    number of filter graph threads, 0 lets libavfilter decide (default)
+ *  -m <mode>       threading mode, "slice" (default) or "none"
+ *  -d              write the output file with O_DIRECT
+ *  -p              pipelined mode, frame generation, filtering and writing each run on their own thread
+ *  -b <threads>    benchmark frames/sec at 1, 2, 4, ... <threads> graph threads, no output is written
+ *  -r <seconds>    print the time spent feeding and pulling the graph every <seconds>, a summary is printed at the end anyway
+ *  -T <file>       write a Chrome trace_event timeline of the input, filter push/pull and write calls
+ *  [log_level]     libav log level
  */
 
 #define FRAME_WIDTH 1280
 #define FRAME_HEIGHT 720
 #define FRAME_FORMAT AV_PIX_FMT_YUV420P
 #define FRAME_COUNT 25
+#define BENCH_FRAME_COUNT 500
 #define OUTPUT_FILE "output.yuv"
+#define PIPELINE_DEPTH 8
+#define MAX_SOURCES 8
 
 typedef struct FilteringContext {
     const char *desc;
@@ -29,92 +56,68 @@ typedef struct FilteringContext {
     AVFilterContext **inputs;
     int nb_outputs;
     AVFilterContext **outputs;
+    int nb_threads;
+    int thread_type; // AVFILTER_THREAD_SLICE or 0, lavfi has no frame threading
+    int nb_frames;
+    int benchmark; // don't write output, don't log per frame
+    int pipelined;
+    int64_t nb_frames_out;
+    AVFrame *frame; // reusable shell for input frames, buffers come from frame_pool
+    FramePool frame_pool;
+    YuvSink sink;
+    YuvSource *sources; // not owned, input i reads sources[i] if i < nb_sources
+    int nb_sources;
+    FilterStats stats;
+    int stats_ready;
+    int64_t report_interval; // microseconds, 0 for the final summary only
 } FilteringContext;
 
-static void save_yuv_frame(AVFrame *frame)
+static int save_yuv_frame(YuvSink *sink, AVFrame *frame)
 {
-    char filename[32];
-    snprintf(filename, sizeof(filename), OUTPUT_FILE);
-    FILE *file = fopen(filename, "ab");
-
-    uint32_t pitch_y = frame->linesize[0];
-    uint32_t pitch_u = frame->linesize[1];
-    uint32_t pitch_v = frame->linesize[2];
-
-    uint8_t *y = frame->data[0];
-    uint8_t *u = frame->data[1];
-    uint8_t *v = frame->data[2];
-
-    for (uint32_t i = 0; i < (uint32_t)frame->height; i++) {
-        fwrite(y, frame->width, 1, file);
-        y += pitch_y;
-    }
-
-    for (uint32_t i = 0; i < (uint32_t)frame->height/2; i++) {
-        fwrite(u, frame->width/2, 1, file);
-        u += pitch_u;
-    }
-
-    for (uint32_t i = 0; i < (uint32_t)frame->height/2; i++) {
-        fwrite(v, frame->width/2, 1, file);
-        v += pitch_v;
-    }
-
-    fclose(file);
+    TRACE_SCOPE("yuv write");
+    int ret = yuv_sink_write(sink, frame);
+    if (ret < 0)
+        printf("Failed to write frame: %s\n", av_err2str(ret));
+    return ret;
 }
 
-static AVFrame *get_dummy_frame(int width, int height, int frame_index, int value)
+static int get_dummy_frame(FilteringContext *fc, AVFrame *frame, int width, int height, int frame_index, int value)
 {
-    if (frame_index >= FRAME_COUNT)
-        return NULL;
+    if (frame_index >= fc->nb_frames)
+        return AVERROR_EOF;
 
     int ret = 0;
-    AVFrame *frame = av_frame_alloc();
-    if (!frame)
-        return NULL;
-
-    frame->format = FRAME_FORMAT;
-    frame->width = width;
-    frame->height = height;
-
-    if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
-        printf("Failed to allocate frame buffer: %s\n", av_err2str(ret));
-        av_frame_free(&frame);
-        return NULL;
+    if ((ret = frame_pool_get(&fc->frame_pool, frame, FRAME_FORMAT, width, height)) < 0) {
+        printf("Failed to get frame buffer from pool: %s\n", av_err2str(ret));
+        return ret;
     }
 
-    for (int y = 0; y < height; ++y)
-        for (int x = 0; x < width; ++x)
-            frame->data[0][y * frame->linesize[0] + x] = x + y + frame_index * 3;
+    frame_gen_fill_overlay(frame->data, frame->linesize, width, height, frame_index, value);
 
-    for (int y = 0; y < height / 2; ++y) {
-        for (int x = 0; x < width / 2; ++x) {
-            frame->data[1][y * frame->linesize[1] + x] = (128 + y + frame_index) * value * 2;
-            frame->data[2][y * frame->linesize[2] + x] = (64 + x + frame_index) * value * 5;
-        }
-    }
-
-    return frame;
+    return 0;
 }
 
-static AVFrame *read_input(FilteringContext *fc, AVFilterContext *fctx)
+static int read_input(FilteringContext *fc, int input_index, AVFrame *frame, int frame_index)
 {
-    // need info to init filters, return a frame that has this info set
-    (void)fc;
-    (void)fctx;
-    return get_dummy_frame(FRAME_WIDTH, FRAME_HEIGHT, 0, 0);
+    TRACE_SCOPE("input frame");
+    if (input_index < fc->nb_sources)
+        return yuv_source_read(&fc->sources[input_index], frame, frame_index);
+    return get_dummy_frame(fc, frame, FRAME_WIDTH, FRAME_HEIGHT, frame_index, input_index);
 }
 
 static int init_input_filter(FilteringContext *fc, AVFilterInOut *in)
 {
     int ret = 0;
-    AVFrame *frame = read_input(fc, in->filter_ctx);
-    if (!frame)
+    // need info to init filters, read a frame that has this info set
+    AVFrame *frame = fc->frame;
+    if (read_input(fc, fc->nb_inputs, frame, 0) < 0)
         return AVERROR(EAGAIN);
 
     AVBufferSrcParameters *params = av_buffersrc_parameters_alloc();
-    if (!params)
+    if (!params) {
+        av_frame_unref(frame);
         return AVERROR(ENOMEM);
+    }
 
     char *filter_name = NULL;
     enum AVMediaType type = avfilter_pad_get_type(in->filter_ctx->input_pads, in->pad_idx);
@@ -135,9 +138,11 @@ static int init_input_filter(FilteringContext *fc, AVFilterInOut *in)
         filter_name = "abuffer";
     } else {
         printf("Only video and audio filters are supported\n");
+        av_frame_unref(frame);
+        av_free(params);
         return AVERROR(EINVAL);
     }
-    av_frame_free(&frame);
+    av_frame_unref(frame);
 
     const AVFilter *filter = avfilter_get_by_name(filter_name);
     AVFilterContext *buffersrc_ctx = NULL;
@@ -217,6 +222,11 @@ static int init_graph(FilteringContext *fc)
     if (!fc->graph)
         return -1;
 
+    // filters pick up the graph's threading settings when they are created, so this
+    // must happen before parsing, let alone avfilter_graph_config()
+    fc->graph->nb_threads = fc->nb_threads;
+    fc->graph->thread_type = fc->thread_type;
+
     printf("Parsing: %s\n", fc->desc);
     if ((ret = avfilter_graph_parse2(fc->graph, fc->desc, &inputs, &outputs)) < 0) {
         printf("Failed to parse filter graph: %s\n", av_err2str(ret));
@@ -245,6 +255,12 @@ static int init_graph(FilteringContext *fc)
         goto end;
     }
 
+    if ((ret = filter_stats_init(&fc->stats, fc->graph, fc->report_interval)) < 0) {
+        fc->failed = 1;
+        goto end;
+    }
+    fc->stats_ready = 1;
+
     fc->initialized = 1;
 
 end:
@@ -259,14 +275,20 @@ static int read_output(FilteringContext *fc)
     int ret = 0;
     for (int i = 0; i < fc->nb_outputs; ++i) {
         AVFrame *frame = av_frame_alloc();
-        ret = av_buffersink_get_frame_flags(fc->outputs[i], frame, 0);
+        TRACE_BEGIN("filter pull");
+        ret = filter_stats_get_frame(&fc->stats, fc->outputs[i], frame, 0);
+        TRACE_END("filter pull");
         if (ret >= 0) {
-            save_yuv_frame(frame);
+            ++fc->nb_frames_out;
+            if (!fc->benchmark && save_yuv_frame(&fc->sink, frame) < 0)
+                fc->failed = 1;
         } else if (ret == AVERROR(EAGAIN)) {
-            printf("No frame available in sink\n");
+            if (!fc->benchmark)
+                printf("No frame available in sink\n");
             ret = 0;
         } else if (ret == AVERROR_EOF) {
-            printf("EOF received\n");
+            if (!fc->benchmark)
+                printf("EOF received\n");
         } else {
             printf("Error occurred while pulling frame from filters: %s\n", av_err2str(ret));
             fc->failed = 1;
@@ -280,34 +302,329 @@ static int feed_input(FilteringContext *fc, int eof, int frame_index)
 {
     int ret = 0;
     for (int i = 0; i < fc->nb_inputs; ++i) {
-        int requested = av_buffersrc_get_nb_failed_requests(fc->inputs[i]);
-        if (requested > 0) {
-            AVFrame *dummy = read_input(fc, fc->inputs[i]);
-            av_frame_free(&dummy);
-        }
-
+        // buffersrc takes the buffer references, leaving fc->frame blank for the next input
         AVFrame *frame = NULL;
-        if (!eof)
-            frame = get_dummy_frame(FRAME_WIDTH, FRAME_HEIGHT, frame_index, i);
-        if ((ret = av_buffersrc_add_frame(fc->inputs[i], frame)) < 0) {
+        if (!eof) {
+            // only the end of the input closes it, anything else is an error
+            if ((ret = read_input(fc, i, fc->frame, frame_index)) >= 0) {
+                frame = fc->frame;
+            } else if (ret != AVERROR_EOF) {
+                printf("Could not read input %d: %s\n", i, av_err2str(ret));
+                fc->failed = 1;
+                return ret;
+            }
+        }
+        TRACE_BEGIN("filter push");
+        ret = filter_stats_add_frame(&fc->stats, fc->inputs[i], frame, 0);
+        TRACE_END("filter push");
+        av_frame_unref(fc->frame);
+        if (ret < 0) {
             printf("Could not pass frame to filter chain: %s\n", av_err2str(ret));
             return ret;
         }
-        av_frame_free(&frame);
     }
     return ret;
 }
 
+/**
+ * Pipelined mode
+ *
+ * producer thread --input_queues[i]--> filter thread --output_queue--> writer thread
+ *
+ * Frame shells travel back on the matching recycle queues, so nothing is allocated
+ * once the pipeline is primed. The filter thread only feeds the inputs the graph
+ * has asked for (av_buffersrc_get_nb_failed_requests()), the bounded queues then
+ * stall the producer, and a slow writer stalls the filter thread in the same way.
+ */
+typedef struct Pipeline {
+    FilteringContext *fc;
+    SpscQueue *input_queues; // producer -> filter, NULL marks EOF
+    SpscQueue *input_recycle; // filter -> producer
+    int *input_eof;
+    int *output_eof;
+    int *producer_eof;
+    int *produced; // frames generated per input, the producer's frame index
+    SpscQueue output_queue; // filter -> writer, NULL marks EOF
+    SpscQueue output_recycle; // writer -> filter
+    AVFrame **frames; // every shell, for cleanup
+    int nb_frames;
+    atomic_int stop; // checked by the producer, set when the filter thread is done
+    atomic_int abort; // checked by everyone, set on error
+    atomic_int ret; // the first error, the others are its fallout
+} Pipeline;
+
+static void pipeline_abort(Pipeline *p, int ret)
+{
+    int expected = 0;
+    atomic_compare_exchange_strong(&p->ret, &expected, ret);
+    atomic_store(&p->abort, 1);
+    atomic_store(&p->stop, 1);
+}
+
+static void *producer_thread(void *arg)
+{
+    Pipeline *p = arg;
+    FilteringContext *fc = p->fc;
+    int nb_eof = 0;
+    int ret = 0;
+
+    trace_thread_name("producer");
+    while (nb_eof < fc->nb_inputs) {
+        int progress = 0;
+        for (int i = 0; i < fc->nb_inputs; ++i) {
+            AVFrame *frame;
+            // an input without a free shell is skipped, the filter thread may be waiting on another one
+            if (p->producer_eof[i] || spsc_queue_pop(&p->input_recycle[i], (void **)&frame) < 0)
+                continue;
+            progress = 1;
+            if ((ret = read_input(fc, i, frame, p->produced[i]++)) == AVERROR_EOF) {
+                // the shell is out of rotation from now on, free_pipeline() still frees it
+                p->producer_eof[i] = 1;
+                ++nb_eof;
+                frame = NULL;
+            } else if (ret < 0) {
+                pipeline_abort(p, ret);
+                return NULL;
+            }
+            // never waits, the queue has room for every shell of the input
+            if ((ret = spsc_queue_push_wait(&p->input_queues[i], frame, &p->stop)) < 0)
+                return NULL;
+        }
+        if (!progress) {
+            if (atomic_load(&p->stop))
+                return NULL;
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static int feed_queued_input(Pipeline *p, int i)
+{
+    int ret = 0;
+    AVFrame *frame;
+    if ((ret = spsc_queue_pop_wait(&p->input_queues[i], (void **)&frame, &p->abort)) < 0)
+        return ret;
+
+    TRACE_BEGIN("filter push");
+    ret = filter_stats_add_frame(&p->fc->stats, p->fc->inputs[i], frame, 0);
+    TRACE_END("filter push");
+    if (!frame) {
+        p->input_eof[i] = 1;
+    } else {
+        av_frame_unref(frame);
+        spsc_queue_push_wait(&p->input_recycle[i], frame, &p->abort);
+    }
+    if (ret < 0)
+        printf("Could not pass frame to filter chain: %s\n", av_err2str(ret));
+
+    return ret;
+}
+
+static void *filter_thread(void *arg)
+{
+    Pipeline *p = arg;
+    FilteringContext *fc = p->fc;
+    AVFrame *frame = NULL;
+    int nb_eof = 0;
+    int ret = 0;
+
+    trace_thread_name("filter");
+    while (nb_eof < fc->nb_outputs) {
+        int progress = 0;
+        for (int i = 0; i < fc->nb_outputs; ++i) {
+            if (p->output_eof[i])
+                continue;
+            if (!frame && (ret = spsc_queue_pop_wait(&p->output_recycle, (void **)&frame, &p->abort)) < 0)
+                goto end;
+
+            TRACE_BEGIN("filter pull");
+            ret = filter_stats_get_frame(&fc->stats, fc->outputs[i], frame, 0);
+            TRACE_END("filter pull");
+            if (ret >= 0) {
+                ++fc->nb_frames_out;
+                progress = 1;
+                if ((ret = spsc_queue_push_wait(&p->output_queue, frame, &p->abort)) < 0)
+                    goto end;
+                frame = NULL;
+            } else if (ret == AVERROR_EOF) {
+                p->output_eof[i] = 1;
+                ++nb_eof;
+            } else if (ret != AVERROR(EAGAIN)) {
+                printf("Error occurred while pulling frame from filters: %s\n", av_err2str(ret));
+                goto end;
+            }
+        }
+        if (progress || nb_eof == fc->nb_outputs)
+            continue;
+
+        // only feed what the graph asked for, anything else would pile up in the graph
+        int fed = 0;
+        for (int i = 0; i < fc->nb_inputs; ++i) {
+            if (p->input_eof[i] || !av_buffersrc_get_nb_failed_requests(fc->inputs[i]))
+                continue;
+            if ((ret = feed_queued_input(p, i)) < 0)
+                goto end;
+            fed = 1;
+        }
+        for (int i = 0; !fed && i < fc->nb_inputs; ++i) {
+            if (p->input_eof[i])
+                continue;
+            if ((ret = feed_queued_input(p, i)) < 0)
+                goto end;
+            fed = 1;
+        }
+        if (!fed)
+            break;
+    }
+    ret = 0;
+
+end:
+    if (ret < 0) {
+        pipeline_abort(p, ret);
+    } else {
+        atomic_store(&p->stop, 1);
+        spsc_queue_push_wait(&p->output_queue, NULL, &p->abort);
+    }
+    return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+    Pipeline *p = arg;
+    AVFrame *frame;
+    int ret = 0;
+
+    trace_thread_name("writer");
+    while (spsc_queue_pop_wait(&p->output_queue, (void **)&frame, &p->abort) >= 0 && frame) {
+        if (!p->fc->benchmark && (ret = save_yuv_frame(&p->fc->sink, frame)) < 0) {
+            // the shell stays in p->frames, free_pipeline() frees it
+            av_frame_unref(frame);
+            pipeline_abort(p, ret);
+            break;
+        }
+        av_frame_unref(frame);
+        if (spsc_queue_push_wait(&p->output_recycle, frame, &p->abort) < 0)
+            break;
+    }
+
+    return NULL;
+}
+
+static void free_pipeline(Pipeline *p)
+{
+    for (int i = 0; i < p->nb_frames; ++i)
+        av_frame_free(&p->frames[i]);
+    av_freep(&p->frames);
+    for (int i = 0; p->input_queues && i < p->fc->nb_inputs; ++i) {
+        spsc_queue_uninit(&p->input_queues[i]);
+        spsc_queue_uninit(&p->input_recycle[i]);
+    }
+    av_freep(&p->input_queues);
+    av_freep(&p->input_recycle);
+    av_freep(&p->input_eof);
+    av_freep(&p->output_eof);
+    av_freep(&p->producer_eof);
+    av_freep(&p->produced);
+    spsc_queue_uninit(&p->output_queue);
+    spsc_queue_uninit(&p->output_recycle);
+}
+
+static int init_pipeline(Pipeline *p, FilteringContext *fc)
+{
+    int ret = 0;
+    p->fc = fc;
+    atomic_init(&p->stop, 0);
+    atomic_init(&p->abort, 0);
+
+    p->input_queues = av_calloc(fc->nb_inputs, sizeof(*p->input_queues));
+    p->input_recycle = av_calloc(fc->nb_inputs, sizeof(*p->input_recycle));
+    p->input_eof = av_calloc(fc->nb_inputs, sizeof(*p->input_eof));
+    p->output_eof = av_calloc(fc->nb_outputs, sizeof(*p->output_eof));
+    p->producer_eof = av_calloc(fc->nb_inputs, sizeof(*p->producer_eof));
+    p->produced = av_calloc(fc->nb_inputs, sizeof(*p->produced));
+    p->frames = av_calloc((fc->nb_inputs + 1) * PIPELINE_DEPTH, sizeof(*p->frames));
+    if (!p->input_queues || !p->input_recycle || !p->input_eof || !p->output_eof || !p->producer_eof ||
+        !p->produced || !p->frames)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i <= fc->nb_inputs; ++i) {
+        // the last queue pair is the output one
+        SpscQueue *queue = i < fc->nb_inputs ? &p->input_queues[i] : &p->output_queue;
+        SpscQueue *recycle = i < fc->nb_inputs ? &p->input_recycle[i] : &p->output_recycle;
+        if ((ret = spsc_queue_init(queue, PIPELINE_DEPTH)) < 0 ||
+            (ret = spsc_queue_init(recycle, PIPELINE_DEPTH)) < 0)
+            return ret;
+        for (int j = 0; j < PIPELINE_DEPTH; ++j) {
+            AVFrame *frame = av_frame_alloc();
+            if (!frame)
+                return AVERROR(ENOMEM);
+            p->frames[p->nb_frames++] = frame;
+            spsc_queue_push(recycle, frame);
+        }
+    }
+
+    return 0;
+}
+
+static void process_pipelined(FilteringContext *fc)
+{
+    int ret = 0;
+    Pipeline p = { 0 };
+    pthread_t producer, filter, writer;
+
+    if ((ret = init_pipeline(&p, fc)) < 0) {
+        printf("Failed to initialize pipeline: %s\n", av_err2str(ret));
+        fc->failed = 1;
+        goto end;
+    }
+
+    if (pthread_create(&producer, NULL, producer_thread, &p)) {
+        fc->failed = 1;
+        goto end;
+    }
+    if (pthread_create(&writer, NULL, writer_thread, &p)) {
+        pipeline_abort(&p, AVERROR(EAGAIN));
+        pthread_join(producer, NULL);
+        fc->failed = 1;
+        goto end;
+    }
+    if (pthread_create(&filter, NULL, filter_thread, &p)) {
+        pipeline_abort(&p, AVERROR(EAGAIN));
+        fc->failed = 1;
+    } else {
+        pthread_join(filter, NULL);
+    }
+    pthread_join(producer, NULL);
+    pthread_join(writer, NULL);
+
+    // every thread is joined, the first error is final
+    if ((ret = atomic_load(&p.ret)) < 0) {
+        printf("Pipeline failed: %s\n", av_err2str(ret));
+        fc->failed = 1;
+    }
+
+end:
+    free_pipeline(&p);
+}
+
 static void process(FilteringContext *fc)
 {
     if (!fc->initialized)
         init_graph(fc);
 
+    if (fc->pipelined) {
+        if (fc->initialized)
+            process_pipelined(fc);
+        return;
+    }
+
     int frame_index = 0;
     while (fc->initialized) {
         int o = read_output(fc);
         int i = feed_input(fc, 0, frame_index);
-        if ((o < 0 && i < 0) || o == AVERROR_EOF)
+        if ((o < 0 && i < 0) || o == AVERROR_EOF || fc->failed)
             break;
         ++frame_index;
     }
@@ -317,36 +634,214 @@ static void process(FilteringContext *fc)
     }
 }
 
+static FilteringContext *alloc_filtering_context(const char *desc, int nb_threads, int thread_type, int pipelined,
+                                                 int64_t report_interval)
+{
+    FilteringContext *fc = av_mallocz(sizeof(*fc));
+    if (!fc)
+        return NULL;
+
+    fc->desc = av_strdup(desc);
+    fc->frame = av_frame_alloc();
+    fc->nb_threads = nb_threads;
+    fc->thread_type = thread_type;
+    fc->pipelined = pipelined;
+    fc->report_interval = report_interval;
+    fc->nb_frames = FRAME_COUNT;
+    fc->sink.fd = -1;
+    if (!fc->desc || !fc->frame) {
+        av_freep(&fc->desc);
+        av_frame_free(&fc->frame);
+        av_free(fc);
+        return NULL;
+    }
+
+    return fc;
+}
+
+static void free_filtering_context(FilteringContext **fcp)
+{
+    FilteringContext *fc = *fcp;
+    if (!fc)
+        return;
+
+    // the graph's filters point into the stats until then
+    if (fc->stats_ready)
+        filter_stats_uninit(&fc->stats);
+    avfilter_graph_free(&fc->graph);
+    av_free(fc->inputs);
+    av_free(fc->outputs);
+    av_freep(&fc->desc);
+    av_frame_free(&fc->frame);
+    frame_pool_uninit(&fc->frame_pool);
+    yuv_sink_close(&fc->sink);
+    av_freep(fcp);
+}
+
+/**
+ * Run the same filterspec with 1, 2, 4, ... max_threads graph threads
+ * Frame generation is included in the timing, output is discarded
+ */
+static int benchmark(const char *desc, int max_threads, int thread_type, int pipelined,
+                     YuvSource *sources, int nb_sources)
+{
+    printf("Benchmarking %d frames of %dx%d, %s threading%s\n", BENCH_FRAME_COUNT, FRAME_WIDTH, FRAME_HEIGHT,
+           thread_type ? "slice" : "no", pipelined ? ", pipelined" : "");
+    printf("%8s %10s %10s\n", "threads", "frames", "fps");
+
+    for (int n = 1; ; n = FFMIN(n * 2, max_threads)) {
+        FilteringContext *fc = alloc_filtering_context(desc, n, thread_type, pipelined, 0);
+        if (!fc)
+            return AVERROR(ENOMEM);
+        fc->nb_frames = BENCH_FRAME_COUNT;
+        fc->benchmark = 1;
+        fc->sources = sources;
+        fc->nb_sources = nb_sources;
+
+        int64_t start = av_gettime_relative();
+        process(fc);
+        int64_t elapsed = av_gettime_relative() - start;
+
+        int failed = fc->failed;
+        if (!failed)
+            printf("%8d %10"PRId64" %10.1f\n", n, fc->nb_frames_out,
+                   elapsed > 0 ? fc->nb_frames_out * 1000000.0 / elapsed : 0.0);
+        free_filtering_context(&fc);
+        if (failed)
+            return AVERROR(EINVAL);
+
+        if (n == max_threads)
+            break;
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int ret = 0;
     FilteringContext *fc = NULL;
     const char *filterspec = "[in1] scale=iw/4:ih/4 [mid1]; [in2] [mid1] overlay=main_w-overlay_w-10:main_h-overlay_h-10:shortest=1 [out1]";
+    int nb_threads = 0;
+    int thread_type = AVFILTER_THREAD_SLICE;
+    int bench_threads = 0;
+    int pipelined = 0;
+    int direct = 0;
+    int64_t report_interval = 0;
+    const char *trace_file = NULL;
+    const char *source_files[MAX_SOURCES];
+    YuvSource sources[MAX_SOURCES] = { 0 };
+    int nb_sources = 0;
+    int source_width = FRAME_WIDTH;
+    int source_height = FRAME_HEIGHT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:s:t:m:dpb:r:T:")) != -1) {
+        switch (opt) {
+        case 'i':
+            if (nb_sources == MAX_SOURCES) {
+                printf("At most %d input files are supported\n", MAX_SOURCES);
+                return 1;
+            }
+            source_files[nb_sources++] = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &source_width, &source_height) != 2) {
+                printf("Invalid size '%s', expected WxH\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            nb_threads = atoi(optarg);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "slice")) {
+                thread_type = AVFILTER_THREAD_SLICE;
+            } else if (!strcmp(optarg, "none")) {
+                thread_type = 0;
+            } else {
+                printf("Unknown threading mode '%s', expected slice or none\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            direct = 1;
+            break;
+        case 'p':
+            pipelined = 1;
+            break;
+        case 'b':
+            bench_threads = atoi(optarg);
+            break;
+        case 'r':
+            report_interval = (int64_t)(atof(optarg) * 1000000);
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        default:
+            printf("Usage: %s [-i file.yuv]... [-s WxH] [-t threads] [-m slice|none] [-d] [-p] [-b max_threads] [-r seconds] [-T trace.json] [log_level]\n", argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc > 1 && argv[1]) {
-        int level = atoi(argv[1]);
+    if (optind < argc && argv[optind]) {
+        int level = atoi(argv[optind]);
         av_log_set_level(level);
     }
 
-    unlink(OUTPUT_FILE);
+    // pick the frame generator kernel before the pipeline threads start using it
+    frame_gen_init(-1);
 
-    fc = av_mallocz(sizeof(*fc));
-    if (!fc)
+    if (trace_file) {
+        trace_start();
+        trace_thread_name("main");
+    }
+
+    for (int i = 0; i < nb_sources; ++i) {
+        if ((ret = yuv_source_open(&sources[i], source_files[i], FRAME_FORMAT, source_width, source_height)) < 0)
+            goto end;
+        printf("Input %d: %s, %d frames\n", i, source_files[i], sources[i].nb_frames);
+    }
+
+    if (bench_threads > 0) {
+        ret = benchmark(filterspec, bench_threads, thread_type, pipelined, sources, nb_sources);
+        goto end;
+    }
+
+    fc = alloc_filtering_context(filterspec, nb_threads, thread_type, pipelined, report_interval);
+    if (!fc) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    fc->sources = sources;
+    fc->nb_sources = nb_sources;
+
+    if ((ret = yuv_sink_open(&fc->sink, OUTPUT_FILE, direct)) < 0)
         goto end;
-    fc->desc = av_strdup(filterspec);
 
     process(fc);
 
-    printf("Play the output file with the command:\nffplay -f rawvideo -pixel_format %s -video_size %dx%d %s\n",
-           av_get_pix_fmt_name(FRAME_FORMAT), FRAME_WIDTH, FRAME_HEIGHT, OUTPUT_FILE);
+    if (fc->stats_ready)
+        filter_stats_print(&fc->stats, "Filter graph summary", 0);
+    frame_pool_print_stats(&fc->frame_pool, "Frame pool");
+    printf("Output: %"PRId64" frames, %"PRId64" bytes in %"PRId64" writes%s\n", fc->sink.nb_frames,
+           fc->sink.nb_bytes, fc->sink.nb_writes, fc->sink.direct ? " (O_DIRECT)" : "");
+
+    if (fc->initialized && fc->nb_outputs > 0)
+        printf("Play the output file with the command:\nffplay -f rawvideo -pixel_format %s -video_size %dx%d %s\n",
+               av_get_pix_fmt_name(av_buffersink_get_format(fc->outputs[0])),
+               av_buffersink_get_w(fc->outputs[0]), av_buffersink_get_h(fc->outputs[0]), OUTPUT_FILE);
+    if (fc->failed)
+        ret = AVERROR(EINVAL);
 end:
-    if (fc) {
-        avfilter_graph_free(&fc->graph);
-        av_free(fc->inputs);
-        av_free(fc->outputs);
-        av_freep(&fc->desc);
-    }
-    av_free(fc);
+    // the graph may still reference mapped frames, free it before unmapping
+    free_filtering_context(&fc);
+    // the pipeline threads were joined in process() and the graph's with it, nothing records anymore
+    if (trace_file)
+        trace_finish(trace_file);
+    for (int i = 0; i < nb_sources; ++i)
+        yuv_source_close(&sources[i]);
 
     return (ret < 0 ? 1 : 0);
 }
@@ -0,0 +1,239 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <libavformat/avformat.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/**
+ * Demuxer read-ahead
+ *
+ * A thread runs av_read_frame() into a bounded ring, so the consumer (decoder,
+ * muxer) only waits on I/O once the ring has run dry and reads go on while it
+ * computes. The ring holds at most max_pkts packets and max_bytes of packet
+ * data, but always takes one packet. AVPacket structs cycle between the ring
+ * and a free list, the only allocations per packet are the data buffers
+ * av_read_frame() itself makes.
+ *
+ * Once started the AVFormatContext belongs to the read-ahead thread until
+ * read_ahead_stop(), hence the stream time base travelling with each packet.
+ * Packets of streams the demuxer adds after the start are dropped. A read
+ * blocked in I/O only ends early through the context's interrupt callback,
+ * live inputs should have one that checks read_ahead_stopping().
+ */
+
+#define READ_AHEAD_NONBLOCK 1
+
+typedef struct ReadAheadInfo {
+    int64_t read_time; // av_gettime_relative() when av_read_frame() returned the packet
+    AVRational time_base; // of the packet's stream
+} ReadAheadInfo;
+
+typedef struct ReadAheadEntry {
+    AVPacket *pkt;
+    ReadAheadInfo info;
+} ReadAheadEntry;
+
+typedef struct ReadAhead {
+    AVFormatContext *ctx;
+    int stream_index; // only queue this stream, -1 (default) for all
+    void (*before_read)(void *opaque); // called on the read-ahead thread before every read, may be NULL
+    void *opaque;
+
+    pthread_t thread;
+    int thread_started;
+    int nb_streams; // when started
+    atomic_int stop;
+
+    // everything below is protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ReadAheadEntry *ring;
+    int size;
+    int head;
+    int count;
+    int64_t bytes;
+    int64_t max_bytes;
+    AVPacket **free_pkts;
+    int nb_free;
+    int status; // 0 while reading, then AVERROR_EOF, the read error or AVERROR_EXIT once stopped
+
+    int64_t nb_pkts;
+    int64_t nb_underruns; // blocking pops that had to wait for a read
+    int64_t nb_full; // times the limits held the reader back
+} ReadAhead;
+
+static inline int read_ahead_full(const ReadAhead *ra)
+{
+    return ra->count == ra->size || (ra->count && ra->bytes >= ra->max_bytes);
+}
+
+static inline int read_ahead_stopping(ReadAhead *ra)
+{
+    return atomic_load(&ra->stop);
+}
+
+static inline void *read_ahead_thread(void *arg)
+{
+    ReadAhead *ra = arg;
+    int ret = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!atomic_load(&ra->stop)) {
+        if (read_ahead_full(ra)) {
+            ++ra->nb_full;
+            while (!atomic_load(&ra->stop) && read_ahead_full(ra))
+                pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        // one more packet than ring slots, so there is always a blank one here
+        AVPacket *pkt = ra->free_pkts[--ra->nb_free];
+        pthread_mutex_unlock(&ra->lock);
+
+        if (ra->before_read)
+            ra->before_read(ra->opaque);
+        ret = av_read_frame(ra->ctx, pkt);
+        ReadAheadInfo info = { .read_time = av_gettime_relative() };
+        int keep = ret >= 0 && pkt->stream_index < ra->nb_streams &&
+                   (ra->stream_index < 0 || pkt->stream_index == ra->stream_index);
+        if (keep)
+            info.time_base = ra->ctx->streams[pkt->stream_index]->time_base;
+        else
+            av_packet_unref(pkt);
+
+        pthread_mutex_lock(&ra->lock);
+        if (!keep) {
+            ra->free_pkts[ra->nb_free++] = pkt;
+            if (ret == AVERROR(EAGAIN)) {
+                // nothing to read yet (pipes, FIFOs, non-blocking protocols), retry like ffmpeg does
+                ret = 0;
+                pthread_mutex_unlock(&ra->lock);
+                av_usleep(10000);
+                pthread_mutex_lock(&ra->lock);
+                continue;
+            }
+            if (ret < 0)
+                break;
+            continue;
+        }
+        ra->ring[(ra->head + ra->count++) % ra->size] = (ReadAheadEntry){ .pkt = pkt, .info = info };
+        ra->bytes += pkt->size;
+        ++ra->nb_pkts;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    ra->status = ret < 0 ? ret : AVERROR_EXIT;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+/**
+ * Allocate the ring and its packets, stream_index, before_read and opaque can be set afterwards
+ */
+static inline int read_ahead_init(ReadAhead *ra, AVFormatContext *ctx, int max_pkts, int64_t max_bytes)
+{
+    memset(ra, 0, sizeof(*ra));
+    ra->ctx = ctx;
+    ra->stream_index = -1;
+    ra->size = FFMAX(max_pkts, 1);
+    ra->max_bytes = max_bytes;
+    atomic_init(&ra->stop, 0);
+
+    ra->ring = av_mallocz_array(ra->size, sizeof(*ra->ring));
+    ra->free_pkts = av_mallocz_array(ra->size + 1, sizeof(*ra->free_pkts));
+    if (!ra->ring || !ra->free_pkts)
+        goto fail;
+    for (; ra->nb_free < ra->size + 1; ++ra->nb_free)
+        if (!(ra->free_pkts[ra->nb_free] = av_packet_alloc()))
+            goto fail;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    return 0;
+
+fail:
+    for (int i = 0; ra->free_pkts && i < ra->nb_free; ++i)
+        av_packet_free(&ra->free_pkts[i]);
+    av_freep(&ra->free_pkts);
+    av_freep(&ra->ring);
+    return AVERROR(ENOMEM);
+}
+
+static inline int read_ahead_start(ReadAhead *ra)
+{
+    ra->nb_streams = ra->ctx->nb_streams;
+    if (pthread_create(&ra->thread, NULL, read_ahead_thread, ra))
+        return AVERROR(EAGAIN);
+    ra->thread_started = 1;
+    return 0;
+}
+
+/**
+ * Move the next packet into pkt, which must be blank
+ * Returns 0, AVERROR(EAGAIN) if none is queued yet and flags has READ_AHEAD_NONBLOCK,
+ * AVERROR_EOF or the read error once every packet before it was popped
+ * info (may be NULL) receives when the packet was read and its stream time base
+ */
+static inline int read_ahead_pop(ReadAhead *ra, AVPacket *pkt, ReadAheadInfo *info, int flags)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    if (!ra->count && !ra->status && !(flags & READ_AHEAD_NONBLOCK)) {
+        ++ra->nb_underruns;
+        while (!ra->count && !ra->status)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+    }
+
+    if (ra->count) {
+        ReadAheadEntry *e = &ra->ring[ra->head];
+        av_packet_move_ref(pkt, e->pkt);
+        if (info)
+            *info = e->info;
+        ra->bytes -= pkt->size;
+        ra->free_pkts[ra->nb_free++] = e->pkt;
+        ra->head = (ra->head + 1) % ra->size;
+        --ra->count;
+        pthread_cond_broadcast(&ra->cond);
+    } else {
+        ret = ra->status ? ra->status : AVERROR(EAGAIN);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return ret;
+}
+
+/**
+ * Stop the thread and free everything, the statistics stay valid
+ * Fine to call on a zeroed or initialized but not started ReadAhead
+ */
+static inline void read_ahead_stop(ReadAhead *ra)
+{
+    if (!ra->ring)
+        return;
+
+    if (ra->thread_started) {
+        pthread_mutex_lock(&ra->lock);
+        atomic_store(&ra->stop, 1);
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+        ra->thread_started = 0;
+    }
+
+    for (; ra->count; --ra->count, ra->head = (ra->head + 1) % ra->size)
+        av_packet_free(&ra->ring[ra->head].pkt);
+    for (int i = 0; i < ra->nb_free; ++i)
+        av_packet_free(&ra->free_pkts[i]);
+    av_freep(&ra->free_pkts);
+    av_freep(&ra->ring);
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cond);
+}
+
+#endif // READ_AHEAD_H
@@ -28,201 +28,823 @@
  * @example remuxing.c
  */
 
+#include <libavutil/avstring.h>
 #include <libavutil/time.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
 #include <signal.h>
-
-static AVFormatContext *ifmt1_ctx = NULL, *ifmt2_ctx = NULL, *ofmt_ctx = NULL;
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "latency_hist.h"
+#include "read_ahead.h"
+#include "trace.h"
+#include "ts_engine.h"
+
+#define NB_INPUTS 2
+#define READER_QUEUE_SIZE 256
+#define READ_AHEAD_PKTS 64
+#define READ_AHEAD_BYTES (8 << 20)
+#define MAX_PENDING_SEGMENTS 16
+
+static AVCodecParameters **out_params = NULL; // one per output stream, every segment gets the same streams
 static int *stream_mapping = NULL;
 static int stream_mapping_size = 0;
 static int stream_index = 0;
 static int nb_pkts = 0;
 
-static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt, const char *tag)
+static int log_packets = 1;
+static int low_latency = 0;
+static int flush_packets = 0;
+static int realtime = 0;
+static int max_pkts = 300; // per input, 0 for no limit
+static int64_t max_interleave_delta = -1; // microseconds, < 0 keeps the muxer default
+static int64_t read_timeout = 5000000; // microseconds
+static int64_t merge_wait = 50000; // microseconds
+static int64_t segment_duration = 0; // microseconds, 0 for no duration limit
+static int64_t segment_size = 0; // bytes, 0 for no size limit
+static const char *out_filename = NULL; // pattern with a %d when segmenting
+static LatencyHist write_latency;
+static StreamTs *stream_ts = NULL; // one per output stream
+static int64_t clock_origin = AV_NOPTS_VALUE;
+static const char *trace_file = NULL;
+static volatile sig_atomic_t stop_requested = 0;
+
+typedef struct QueuedPacket {
+    AVPacket *pkt; // stream_index already mapped to the output
+    AVRational time_base; // of the input stream
+    int64_t key; // input clock time, orders the merge and gives the output timestamps
+    int64_t ingest_time;
+} QueuedPacket;
+
+/**
+ * One thread per input so a stalled source can't hold up the other one, and under
+ * it a read-ahead thread doing the I/O so reads go on while the reader paces and queues
+ * The queue, finished and error are protected by merge_lock
+ */
+typedef struct InputReader {
+    int index;
+    const char *filename;
+    AVFormatContext *ctx;
+    ReadAhead read_ahead; // owns ctx while the reader runs
+    int *mapping;
+    InputClock clock; // also paces the input at its native rate (-r)
+    pthread_t thread;
+    int thread_started;
+    atomic_llong deadline; // av_gettime_relative() past which a blocking call is interrupted
+    int nb_pkts;
+
+    QueuedPacket queue[READER_QUEUE_SIZE];
+    int head;
+    int count;
+    int finished;
+    int error;
+} InputReader;
+
+static InputReader readers[NB_INPUTS];
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_cond;
+
+typedef struct Segment {
+    AVFormatContext *ctx;
+    char filename[1024];
+    int index;
+    int64_t start_key; // merge clock of its first packet
+    int64_t nb_pkts;
+} Segment;
+
+/**
+ * Segments are cut on the write path but opened and finalized by a worker thread,
+ * so the muxer never waits for a header, a trailer (the mp4 index) or an fsync.
+ * The worker keeps the next segment opened ahead of time and finalizes the
+ * finished ones in order, everything below is protected by segment_lock.
+ */
+static Segment *cur_segment = NULL; // only touched by the muxing thread
+static pthread_t segment_thread;
+static int segment_thread_started = 0;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t segment_cond = PTHREAD_COND_INITIALIZER;
+static Segment *finish_queue[MAX_PENDING_SEGMENTS];
+static int nb_finish = 0;
+static Segment *next_segment = NULL;
+static int next_index = 0;
+static int next_wanted = 0;
+static int next_error = 0;
+static int segment_quit = 0;
+
+static void handle_signal(int sig)
 {
-    AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
+    (void)sig;
+    stop_requested = 1;
+}
 
+static void log_packet(AVRational time_base, const AVPacket *pkt, const char *tag, int n)
+{
     printf("%s (%d): pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
-           tag, nb_pkts,
-           av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
-           av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
-           av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
+           tag, n,
+           av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &time_base),
+           av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &time_base),
+           av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, &time_base),
            pkt->stream_index);
 }
 
-static int open_input(AVFormatContext *ifmt_ctx, const char *in_filename)
+/**
+ * Called by libavformat while it blocks on an input, a non-zero return aborts the call
+ */
+static int interrupt_cb(void *opaque)
+{
+    InputReader *r = opaque;
+    return stop_requested || read_ahead_stopping(&r->read_ahead) ||
+           av_gettime_relative() > atomic_load(&r->deadline);
+}
+
+static int open_input(InputReader *r)
 {
     int ret;
-    if ((ret = avformat_open_input(&ifmt_ctx, in_filename, 0, 0)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'", in_filename);
+
+    if (!(r->ctx = avformat_alloc_context()))
+        return AVERROR(ENOMEM);
+    // don't let stream probing queue up packets we then deliver late
+    if (low_latency)
+        r->ctx->flags |= AVFMT_FLAG_NOBUFFER;
+    r->ctx->interrupt_callback.callback = interrupt_cb;
+    r->ctx->interrupt_callback.opaque = r;
+    atomic_store(&r->deadline, av_gettime_relative() + read_timeout);
+
+    if ((ret = avformat_open_input(&r->ctx, r->filename, 0, 0)) < 0) {
+        fprintf(stderr, "Could not open input file '%s'", r->filename);
         return ret;
     }
 
-    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
+    atomic_store(&r->deadline, av_gettime_relative() + read_timeout);
+    if ((ret = avformat_find_stream_info(r->ctx, 0)) < 0) {
         fprintf(stderr, "Failed to retrieve input stream information");
         return ret;
     }
 
-    av_dump_format(ifmt_ctx, 0, in_filename, 0);
+    av_dump_format(r->ctx, 0, r->filename, 0);
+    return 0;
 }
 
-static int create_streams(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx)
+static int create_streams(AVFormatContext *ifmt_ctx, int *mapping)
 {
     int i, ret = 0;
     for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        AVStream *out_stream;
+        AVCodecParameters *out_codecpar;
         AVStream *in_stream = ifmt_ctx->streams[i];
         AVCodecParameters *in_codecpar = in_stream->codecpar;
 
         if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
             in_codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
             in_codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) {
-            stream_mapping[i] = -1;
+            mapping[i] = -1;
             continue;
         }
 
-        stream_mapping[i] = stream_index++;
-
-        out_stream = avformat_new_stream(ofmt_ctx, NULL);
-        if (!out_stream) {
+        out_codecpar = avcodec_parameters_alloc();
+        if (!out_codecpar) {
             fprintf(stderr, "Failed allocating output stream\n");
-            ret = AVERROR_UNKNOWN;
+            ret = AVERROR(ENOMEM);
             return ret;
         }
+        out_params[stream_index] = out_codecpar;
+        mapping[i] = stream_index++;
 
-        ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
+        ret = avcodec_parameters_copy(out_codecpar, in_codecpar);
         if (ret < 0) {
             fprintf(stderr, "Failed to copy codec parameters\n");
             return ret;
         }
-        out_stream->codecpar->codec_tag = 0;
+        out_codecpar->codec_tag = 0;
     }
 
     return ret;
 }
 
-static int remux_pkt(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx)
+static int open_segment(int index, Segment **segment)
 {
     int ret;
-    AVStream *in_stream, *out_stream;
-    AVPacket pkt;
+    AVFormatContext *ofmt_ctx = NULL;
+    Segment *seg = av_mallocz(sizeof(*seg));
+    if (!seg)
+        return AVERROR(ENOMEM);
+    seg->index = index;
+    seg->start_key = AV_NOPTS_VALUE;
+
+    if (segment_duration || segment_size) {
+        if (av_get_frame_filename(seg->filename, sizeof(seg->filename), out_filename, index) < 0) {
+            fprintf(stderr, "Segmented output needs a %%d in its name, e.g. out%%03d.mp4\n");
+            ret = AVERROR(EINVAL);
+            goto fail;
+        }
+    } else {
+        av_strlcpy(seg->filename, out_filename, sizeof(seg->filename));
+    }
 
-    ret = av_read_frame(ifmt_ctx, &pkt);
+    avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, seg->filename);
+    if (!ofmt_ctx) {
+        fprintf(stderr, "Could not create output context\n");
+        ret = AVERROR_UNKNOWN;
+        goto fail;
+    }
+    seg->ctx = ofmt_ctx;
+
+    // 0 would mean no limit to the muxer, we write directly instead
+    if (max_interleave_delta > 0)
+        ofmt_ctx->max_interleave_delta = max_interleave_delta;
+    if (flush_packets) {
+        ofmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        ofmt_ctx->flush_packets = 1;
+    }
+
+    for (int i = 0; i < stream_index; i++) {
+        AVStream *out_stream = avformat_new_stream(ofmt_ctx, NULL);
+        if (!out_stream) {
+            fprintf(stderr, "Failed allocating output stream\n");
+            ret = AVERROR_UNKNOWN;
+            goto fail;
+        }
+        if ((ret = avcodec_parameters_copy(out_stream->codecpar, out_params[i])) < 0) {
+            fprintf(stderr, "Failed to copy codec parameters\n");
+            goto fail;
+        }
+    }
+
+    if (!index)
+        av_dump_format(ofmt_ctx, 0, seg->filename, 1);
+
+    if (!(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&ofmt_ctx->pb, seg->filename, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            fprintf(stderr, "Could not open output file '%s'", seg->filename);
+            goto fail;
+        }
+    }
+
+    ret = avformat_write_header(ofmt_ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when opening output file\n");
+        goto fail;
+    }
+
+    *segment = seg;
+    return 0;
+
+fail:
+    if (ofmt_ctx && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&ofmt_ctx->pb);
+    avformat_free_context(ofmt_ctx);
+    av_free(seg);
+    return ret;
+}
+
+/**
+ * Make the file and its directory entry durable, AVIOContext doesn't expose its fd so it's reopened
+ */
+static void sync_file(const char *filename)
+{
+    char dir[1024];
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        if (fsync(fd) < 0)
+            fprintf(stderr, "fsync of '%s' failed\n", filename);
+        close(fd);
+    }
+
+    av_strlcpy(dir, filename, sizeof(dir));
+    if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Write the trailer (when finalize is set), close and free the segment
+ * A segment that never got a packet is removed instead, unless it's the only output
+ */
+static int close_segment(Segment **segment, int finalize)
+{
+    int ret = 0;
+    Segment *seg = *segment;
+    if (!seg)
+        return 0;
+
+    int nofile = seg->ctx->oformat->flags & AVFMT_NOFILE;
+    int keep = seg->nb_pkts || (!segment_duration && !segment_size);
+    if (finalize && keep && (ret = av_write_trailer(seg->ctx)) < 0)
+        fprintf(stderr, "Error writing trailer of '%s': %s\n", seg->filename, av_err2str(ret));
+    if (!nofile)
+        avio_closep(&seg->ctx->pb);
+    avformat_free_context(seg->ctx);
+
+    if (!nofile) {
+        if (keep)
+            sync_file(seg->filename);
+        else
+            unlink(seg->filename);
+    }
+
+    av_freep(segment);
+    return ret;
+}
+
+static void *segment_worker(void *arg)
+{
+    (void)arg;
+
+    trace_thread_name("segment worker");
+    pthread_mutex_lock(&segment_lock);
+    for (;;) {
+        // the next segment first, a cut may be waiting for it
+        if (next_wanted && !next_segment) {
+            Segment *seg = NULL;
+            int index = next_index;
+            pthread_mutex_unlock(&segment_lock);
+            TRACE_BEGIN("segment open");
+            int ret = open_segment(index, &seg);
+            TRACE_END("segment open");
+            pthread_mutex_lock(&segment_lock);
+            next_segment = seg;
+            next_error = ret;
+            next_wanted = 0;
+            pthread_cond_broadcast(&segment_cond);
+            continue;
+        }
+        if (nb_finish) {
+            Segment *seg = finish_queue[0];
+            memmove(finish_queue, finish_queue + 1, --nb_finish * sizeof(*finish_queue));
+            pthread_cond_broadcast(&segment_cond);
+            pthread_mutex_unlock(&segment_lock);
+            int64_t start = av_gettime_relative();
+            TRACE_BEGIN("segment finalize");
+            close_segment(&seg, 1);
+            TRACE_END("segment finalize");
+            printf("Segment finalized in %.1f ms\n", (av_gettime_relative() - start) / 1000.0);
+            pthread_mutex_lock(&segment_lock);
+            continue;
+        }
+        if (segment_quit)
+            break;
+        pthread_cond_wait(&segment_cond, &segment_lock);
+    }
+    pthread_mutex_unlock(&segment_lock);
+
+    return NULL;
+}
+
+/**
+ * Switch to the pre-opened segment when pkt is a keyframe (of a video stream if there is one)
+ * and the current segment is long or big enough
+ */
+static int maybe_cut_segment(const QueuedPacket *qp)
+{
+    int ret = 0;
+    Segment *seg = cur_segment;
+    AVFormatContext *ofmt_ctx = seg->ctx;
+
+    if (seg->start_key == AV_NOPTS_VALUE)
+        seg->start_key = qp->key;
+    if (!segment_duration && !segment_size)
+        return 0;
+
+    if (!(qp->pkt->flags & AV_PKT_FLAG_KEY))
+        return 0;
+    int has_video = 0;
+    for (int i = 0; i < ofmt_ctx->nb_streams; i++)
+        has_video |= ofmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+    if (has_video && ofmt_ctx->streams[qp->pkt->stream_index]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+        return 0;
+
+    int due = (segment_duration && qp->key - seg->start_key >= segment_duration) ||
+              (segment_size && ofmt_ctx->pb && avio_tell(ofmt_ctx->pb) >= segment_size);
+    if (!due)
+        return 0;
+
+    pthread_mutex_lock(&segment_lock);
+    // only waits if the worker couldn't keep up
+    while (next_wanted || nb_finish == MAX_PENDING_SEGMENTS)
+        pthread_cond_wait(&segment_cond, &segment_lock);
+    Segment *next = next_segment;
+    next_segment = NULL;
+    if (next) {
+        finish_queue[nb_finish++] = seg;
+        next_index = next->index + 1;
+        next_wanted = 1;
+        pthread_cond_broadcast(&segment_cond);
+    } else {
+        ret = next_error < 0 ? next_error : AVERROR_BUG;
+    }
+    pthread_mutex_unlock(&segment_lock);
     if (ret < 0)
         return ret;
 
-    in_stream  = ifmt_ctx->streams[pkt.stream_index];
-    if (pkt.stream_index >= stream_mapping_size ||
-        stream_mapping[pkt.stream_index] < 0) {
-        av_packet_unref(&pkt);
-        return 0;
+    next->start_key = qp->key;
+    cur_segment = next;
+    printf("Segment %d: %s\n", next->index, next->filename);
+    return 0;
+}
+
+static void wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, int64_t t)
+{
+    struct timespec ts = { .tv_sec = t / 1000000, .tv_nsec = t % 1000000 * 1000 };
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+// arms the read timeout, on the read-ahead thread
+static void reader_before_read(void *opaque)
+{
+    InputReader *r = opaque;
+    atomic_store(&r->deadline, av_gettime_relative() + read_timeout);
+}
+
+static void *reader_thread(void *arg)
+{
+    InputReader *r = arg;
+    AVPacket *pkt = av_packet_alloc();
+    ReadAheadInfo info;
+    char name[32];
+    int ret = pkt ? 0 : AVERROR(ENOMEM);
+
+    snprintf(name, sizeof(name), "reader %d", r->index);
+    trace_thread_name(name);
+
+    if (ret >= 0 && (ret = read_ahead_init(&r->read_ahead, r->ctx, READ_AHEAD_PKTS, READ_AHEAD_BYTES)) >= 0) {
+        r->read_ahead.before_read = reader_before_read;
+        r->read_ahead.opaque = r;
+        ret = read_ahead_start(&r->read_ahead);
+    }
+
+    while (ret >= 0 && !stop_requested && (!max_pkts || r->nb_pkts < max_pkts)) {
+        TRACE_BEGIN("read wait");
+        ret = read_ahead_pop(&r->read_ahead, pkt, &info, 0);
+        TRACE_END("read wait");
+        if (ret < 0)
+            break;
+
+        if (r->mapping[pkt->stream_index] < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        // latency is counted from the moment the packet is read, which is also its arrival for the clock,
+        // unless paced (-r): then it arrives when let through
+        int64_t now = info.read_time;
+        int64_t key = input_clock_predict(&r->clock, pkt->dts, info.time_base, now);
+        if (realtime) {
+            now = av_gettime_relative();
+            if (key > now) {
+                TRACE_BEGIN("pace");
+                av_usleep(key - now);
+                TRACE_END("pace");
+                now = av_gettime_relative();
+            }
+        }
+        key = input_clock_correct(&r->clock, key, now);
+
+        QueuedPacket qp = { .time_base = info.time_base, .key = key, .ingest_time = now };
+        if (log_packets)
+            log_packet(info.time_base, pkt, "in", r->nb_pkts);
+        if (!(qp.pkt = av_packet_alloc())) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        av_packet_move_ref(qp.pkt, pkt);
+        qp.pkt->stream_index = r->mapping[qp.pkt->stream_index];
+
+        pthread_mutex_lock(&merge_lock);
+        while (r->count == READER_QUEUE_SIZE && !stop_requested)
+            pthread_cond_wait(&merge_cond, &merge_lock);
+        if (stop_requested) {
+            pthread_mutex_unlock(&merge_lock);
+            av_packet_free(&qp.pkt);
+            break;
+        }
+        r->queue[(r->head + r->count++) % READER_QUEUE_SIZE] = qp;
+        ++r->nb_pkts;
+        pthread_cond_broadcast(&merge_cond);
+        pthread_mutex_unlock(&merge_lock);
     }
 
-    pkt.stream_index = stream_mapping[pkt.stream_index];
-    out_stream = ofmt_ctx->streams[pkt.stream_index];
-    log_packet(ifmt_ctx, &pkt, "in");
+    if (ret == AVERROR_EXIT && !stop_requested)
+        fprintf(stderr, "Input %d (%s) timed out, dropped\n", r->index, r->filename);
+    else if (ret < 0 && ret != AVERROR_EOF && ret != AVERROR_EXIT)
+        fprintf(stderr, "Input %d (%s) failed: %s, dropped\n", r->index, r->filename, av_err2str(ret));
+
+    av_packet_free(&pkt);
+    read_ahead_stop(&r->read_ahead);
+    pthread_mutex_lock(&merge_lock);
+    r->finished = 1;
+    r->error = ret == AVERROR_EOF || ret == AVERROR_EXIT ? 0 : ret;
+    pthread_cond_broadcast(&merge_cond);
+    pthread_mutex_unlock(&merge_lock);
+
+    return NULL;
+}
 
-    /* copy packet */
-    pkt.pts = av_rescale_q_rnd(av_gettime(), in_stream->time_base, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-    pkt.dts = av_rescale_q_rnd(av_gettime(), in_stream->time_base, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-    pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->time_base);
-    pkt.pos = -1;
-    log_packet(ofmt_ctx, &pkt, "out");
+static int write_pkt(QueuedPacket *qp)
+{
+    int ret;
+    AVPacket *pkt = qp->pkt;
 
-    ret = av_interleaved_write_frame(ofmt_ctx, &pkt);
+    if ((ret = maybe_cut_segment(qp)) < 0) {
+        av_packet_free(&qp->pkt);
+        return ret;
+    }
+    AVFormatContext *ofmt_ctx = cur_segment->ctx;
+    AVStream *out_stream = ofmt_ctx->streams[pkt->stream_index];
+
+    /* copy packet, the recording starts at the first packet written */
+    if (clock_origin == AV_NOPTS_VALUE)
+        clock_origin = qp->key;
+    stream_ts_map(&stream_ts[pkt->stream_index], pkt, qp->key - clock_origin, qp->time_base, out_stream->time_base);
+    pkt->duration = av_rescale_q(pkt->duration, qp->time_base, out_stream->time_base);
+    pkt->pos = -1;
+    if (log_packets)
+        log_packet(out_stream->time_base, pkt, "out", nb_pkts);
+
+    // without an interleave delta, packets go straight to the muxer instead of waiting for the other streams
+    TRACE_BEGIN("mux");
+    if (max_interleave_delta == 0 || (low_latency && max_interleave_delta < 0))
+        ret = av_write_frame(ofmt_ctx, pkt);
+    else
+        ret = av_interleaved_write_frame(ofmt_ctx, pkt);
+    TRACE_END("mux");
+    av_packet_free(&qp->pkt);
     if (ret < 0) {
         fprintf(stderr, "Error muxing packet\n");
         return ret;
     }
-    av_packet_unref(&pkt);
+    if (flush_packets && ofmt_ctx->pb) {
+        TRACE_BEGIN("flush");
+        avio_flush(ofmt_ctx->pb);
+        TRACE_END("flush");
+    }
+
+    latency_hist_add(&write_latency, av_gettime_relative() - qp->ingest_time);
+    ++cur_segment->nb_pkts;
+    ++nb_pkts;
+    return 0;
+}
+
+/**
+ * Write the queued packets of all inputs in timestamp order until every reader is done
+ *
+ * The earliest queued packet is held while a live input has nothing queued, in case
+ * that input delivers an earlier one, but never more than merge_wait after it was read.
+ */
+static int merge_inputs(void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&merge_lock);
+    for (;;) {
+        InputReader *best = NULL;
+        int nb_finished = 0, starved = 0;
+
+        // readers can't be woken from the signal handler, they're waiting on us
+        if (stop_requested)
+            pthread_cond_broadcast(&merge_cond);
+
+        for (int i = 0; i < NB_INPUTS; ++i) {
+            InputReader *r = &readers[i];
+            if (r->count) {
+                if (!best || r->queue[r->head].key < best->queue[best->head].key)
+                    best = r;
+            } else if (r->finished) {
+                ++nb_finished;
+            } else {
+                starved = 1;
+            }
+            if (r->error < 0 && !ret)
+                ret = r->error;
+        }
+
+        if (!best) {
+            if (nb_finished == NB_INPUTS)
+                break;
+            wait_until(&merge_cond, &merge_lock, av_gettime_relative() + 100000);
+            continue;
+        }
+
+        int64_t release_time = best->queue[best->head].ingest_time + merge_wait;
+        if (starved && !stop_requested && av_gettime_relative() < release_time) {
+            wait_until(&merge_cond, &merge_lock, release_time);
+            continue;
+        }
+
+        QueuedPacket qp = best->queue[best->head];
+        best->head = (best->head + 1) % READER_QUEUE_SIZE;
+        --best->count;
+        pthread_cond_broadcast(&merge_cond);
+        pthread_mutex_unlock(&merge_lock);
+
+        int err = write_pkt(&qp);
+
+        pthread_mutex_lock(&merge_lock);
+        if (err < 0) {
+            ret = err;
+            stop_requested = 1;
+        }
+    }
+    pthread_mutex_unlock(&merge_lock);
+
+    return ret;
 }
 
 int main(int argc, char **argv)
 {
-    AVOutputFormat *ofmt = NULL;
-    const char *in1_filename, *in2_filename, *out_filename;
-    int ret, i;
+    int verbose = 0;
+    int ret, opt;
+
+    while ((opt = getopt(argc, argv, "ld:frn:vt:w:s:S:T:")) != -1) {
+        switch (opt) {
+        case 'l':
+            low_latency = 1;
+            flush_packets = 1;
+            break;
+        case 'd':
+            max_interleave_delta = atoll(optarg) * 1000;
+            break;
+        case 'f':
+            flush_packets = 1;
+            break;
+        case 'r':
+            realtime = 1;
+            break;
+        case 'n':
+            max_pkts = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 't':
+            read_timeout = atoll(optarg) * 1000;
+            break;
+        case 'w':
+            merge_wait = atoll(optarg) * 1000;
+            break;
+        case 's':
+            segment_duration = atof(optarg) * 1000000;
+            break;
+        case 'S':
+            segment_size = atoll(optarg) * 1000000;
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
 
-    if (argc < 4) {
-        printf("usage: %s input input output\n"
+    if (argc - optind < 3) {
+        printf("usage: %s [-l] [-d max_interleave_delta_ms] [-f] [-r] [-n max_pkts] [-v] [-t timeout_ms] [-w merge_wait_ms] [-s seconds] [-S MB] [-T trace.json] input input output\n"
                "API example program to remux 2 RTP streams with libavformat and libavcodec.\n"
                "The output format is guessed according to the file extension.\n"
+               "  -l  low latency: packets are written as soon as they're read and flushed,\n"
+               "      unless -d asks for interleaving\n"
+               "  -d  interleave, holding packets at most this long for the other streams,\n"
+               "      0 writes them directly\n"
+               "  -f  flush the output after every packet\n"
+               "  -r  read inputs at their native rate, for files standing in for live sources\n"
+               "  -n  stop after this many packets per input, 0 for no limit (default 300)\n"
+               "  -v  log every packet (default unless -l)\n"
+               "  -t  drop an input that blocks longer than this (default 5000)\n"
+               "  -w  hold a packet at most this long for an earlier one from the other input (default 50)\n"
+               "  -s  start a new segment on the first keyframe after this many seconds\n"
+               "  -S  start a new segment on the first keyframe after this many MB\n"
+               "      segmented output names need a %%d, e.g. out%%03d.mp4\n"
+               "  -T  write a Chrome trace_event timeline of the reads, pacing, muxing and segment work\n"
                , argv[0]);
         return 1;
     }
 
-    in1_filename = argv[1];
-    in2_filename = argv[2];
-    out_filename = argv[3];
-
-    if ((ret = open_input(ifmt1_ctx, in1_filename)) < 0)
-        goto end;
-
-    if ((ret = open_input(ifmt2_ctx, in2_filename)) < 0)
-        goto end;
+    out_filename = argv[optind + 2];
+    // printing two lines per packet costs more than the write itself
+    log_packets = verbose || !low_latency;
+    latency_hist_reset(&write_latency);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    if (trace_file) {
+        trace_start();
+        trace_thread_name("mux");
+    }
 
-    avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, out_filename);
-    if (!ofmt_ctx) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        goto end;
+    // av_gettime_relative() is CLOCK_MONOTONIC, timed waits use the same clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&merge_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (int i = 0; i < NB_INPUTS; ++i) {
+        readers[i].index = i;
+        readers[i].filename = argv[optind + i];
+        input_clock_init(&readers[i].clock);
+        if ((ret = open_input(&readers[i])) < 0)
+            goto end;
     }
 
-    stream_mapping_size = ifmt1_ctx->nb_streams + ifmt2_ctx->nb_streams;
+    // the streams of each input are mapped after the ones of the previous input
+    for (int i = 0; i < NB_INPUTS; ++i)
+        stream_mapping_size += readers[i].ctx->nb_streams;
     stream_mapping = av_mallocz_array(stream_mapping_size, sizeof(*stream_mapping));
-    if (!stream_mapping) {
+    out_params = av_mallocz_array(stream_mapping_size, sizeof(*out_params));
+    stream_ts = av_malloc_array(stream_mapping_size, sizeof(*stream_ts));
+    if (!stream_mapping || !out_params || !stream_ts) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
-    ofmt = ofmt_ctx->oformat;
-
-    if ((ret = create_streams(ifmt1_ctx, ofmt_ctx)) < 0)
-        goto end;
+    for (int i = 0, offset = 0; i < NB_INPUTS; offset += readers[i++].ctx->nb_streams) {
+        readers[i].mapping = stream_mapping + offset;
+        if ((ret = create_streams(readers[i].ctx, readers[i].mapping)) < 0)
+            goto end;
+    }
+    for (int i = 0; i < stream_index; i++)
+        stream_ts_init(&stream_ts[i]);
 
-    if ((ret = create_streams(ifmt2_ctx, ofmt_ctx)) < 0)
+    if ((ret = open_segment(0, &cur_segment)) < 0)
         goto end;
 
-    av_dump_format(ofmt_ctx, 0, out_filename, 1);
-
-    if (!(ofmt->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&ofmt_ctx->pb, out_filename, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Could not open output file '%s'", out_filename);
+    if (segment_duration || segment_size) {
+        if (pthread_create(&segment_thread, NULL, segment_worker, NULL)) {
+            ret = AVERROR(EAGAIN);
             goto end;
         }
+        segment_thread_started = 1;
+        pthread_mutex_lock(&segment_lock);
+        next_index = 1;
+        next_wanted = 1;
+        pthread_cond_broadcast(&segment_cond);
+        pthread_mutex_unlock(&segment_lock);
+        printf("Segment 0: %s\n", cur_segment->filename);
     }
 
-    ret = avformat_write_header(ofmt_ctx, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Error occurred when opening output file\n");
-        goto end;
+    for (int i = 0; i < NB_INPUTS; ++i) {
+        if (pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i])) {
+            fprintf(stderr, "Failed to start reader for input %d\n", i);
+            readers[i].finished = 1;
+            continue;
+        }
+        readers[i].thread_started = 1;
     }
 
-    while (1) {
-        if ((ret = remux_pkt(ifmt1_ctx, ofmt_ctx)) < 0)
-            break;
-        if ((ret = remux_pkt(ifmt2_ctx, ofmt_ctx)) < 0)
-            break;
-        if (nb_pkts++ > 300)
-            break;
-    }
+    ret = merge_inputs();
 
-    av_write_trailer(ofmt_ctx);
+    latency_hist_print(&write_latency, "Ingest to write latency");
+    for (int i = 0; i < NB_INPUTS; ++i)
+        if (readers[i].clock.nb_resyncs)
+            printf("Input %d: clock re-anchored %d times\n", i, readers[i].clock.nb_resyncs);
+    for (int i = 0; i < stream_index; ++i)
+        if (stream_ts[i].nb_fixups)
+            printf("Stream %d: %d non-increasing dts pushed forward\n", i, stream_ts[i].nb_fixups);
 
 end:
-    /* close inputs */
-    avformat_close_input(&ifmt1_ctx);
-    avformat_close_input(&ifmt2_ctx);
-
-    /* close output */
-    if (ofmt_ctx && !(ofmt->flags & AVFMT_NOFILE))
-        avio_closep(&ofmt_ctx->pb);
-    avformat_free_context(ofmt_ctx);
+    /* stop readers and close inputs */
+    stop_requested = 1;
+    pthread_mutex_lock(&merge_lock);
+    pthread_cond_broadcast(&merge_cond);
+    pthread_mutex_unlock(&merge_lock);
+    for (int i = 0; i < NB_INPUTS; ++i) {
+        InputReader *r = &readers[i];
+        if (r->thread_started) {
+            pthread_join(r->thread, NULL);
+            printf("Input %d: %"PRId64" packets read ahead, reader waited on input %"PRId64" times, ring full %"PRId64" times\n",
+                   i, r->read_ahead.nb_pkts, r->read_ahead.nb_underruns, r->read_ahead.nb_full);
+        }
+        for (; r->count; --r->count, r->head = (r->head + 1) % READER_QUEUE_SIZE)
+            av_packet_free(&r->queue[r->head].pkt);
+        avformat_close_input(&r->ctx);
+    }
+    pthread_cond_destroy(&merge_cond);
+
+    /* close output, the pending segments are finalized before the worker exits */
+    if (segment_thread_started) {
+        pthread_mutex_lock(&segment_lock);
+        segment_quit = 1;
+        pthread_cond_broadcast(&segment_cond);
+        pthread_mutex_unlock(&segment_lock);
+        pthread_join(segment_thread, NULL);
+    }
+    close_segment(&next_segment, 0);
+    close_segment(&cur_segment, 1);
 
+    for (int i = 0; i < stream_index; i++)
+        avcodec_parameters_free(&out_params[i]);
+    av_freep(&out_params);
+    av_freep(&stream_ts);
     av_freep(&stream_mapping);
 
+    // after the readers and the segment worker were joined
+    if (trace_file)
+        trace_finish(trace_file);
+
     if (ret < 0 && ret != AVERROR_EOF) {
         fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
         return 1;
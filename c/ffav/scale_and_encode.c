@@ -6,37 +6,107 @@
 #include <libswscale/swscale.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "frame_pool.h"
+#include "read_ahead.h"
+#include "slice_scale.h"
+#include "trace.h"
+#include "work_pool.h"
 
 // Can't scale unless format is software
 // Can't hardware encode unless format is hardware
 
-static AVFormatContext *ifmt_ctx = NULL;
-static AVFormatContext *ofmt_ctx = NULL;
-static AVCodecContext *dec_ctx = NULL;
-static AVCodecContext *enc_ctx = NULL;
-static AVBufferRef *hw_device_ctx = NULL;
-static struct SwsContext *sws_ctx = NULL;
+/**
+ * Everything one input -> output transcode owns
+ * Jobs share nothing but the read-only options below, so a batch runs them side by side
+ */
+typedef struct TranscodeJob {
+    const char *input_file;
+    const char *output_file;
+    int nb_threads; // decoder, encoder and scaler threads, 0 picks one per core
+
+    AVFormatContext *ifmt_ctx;
+    AVFormatContext *ofmt_ctx;
+    ReadAhead read_ahead; // demuxes ahead of the decoder, owns ifmt_ctx while running
+    AVCodecContext *dec_ctx;
+    AVCodecContext *enc_ctx;
+    AVBufferRef *hw_device_ctx;
+    int video_stream_idx;
+    const char *encoder_name;
+
+    enum AVPixelFormat scale_fmt; // what sws_scale writes, NV12 for VAAPI uploads
+    SliceScaler scaler;
+    int scaler_ready;
+    // the input the scaler was built for
+    int scaler_w;
+    int scaler_h;
+    enum AVPixelFormat scaler_fmt;
+    FramePool out_pool;
+    AVFrame *in_frame;
+    AVFrame *out_frame;
+    AVFrame *hw_frame;
+    AVPacket *enc_pkt;
+
+    int64_t nb_frames_encoded;
+    int64_t nb_frames_passthrough;
+    int64_t scale_ns;
+    int64_t scale_bytes; // read + written by conversions
+    int64_t wall_ns;
+    int ret;
+
+    // chunked mode, the job covers one range of the input and keeps its packets for stitching
+    int chunked;
+    int global_header;
+    int64_t chunk_start_dts; // packets from the keyframe starting the chunk (input time base)
+    int64_t chunk_end_dts; // to the one starting the next chunk, plus the pictures displayed before it
+    int64_t chunk_start_pts; // frames kept
+    int64_t chunk_end_pts;
+    AVPacket **chunk_pkts; // encoder time base
+    int nb_chunk_pkts;
+    int chunk_done;
+} TranscodeJob;
+
+static int use_hw = 1;
+static const char *sw_encoder = NULL;
+
+// read-ahead ring limits, a few seconds of high bitrate video
+#define READ_AHEAD_PKTS 128
+#define READ_AHEAD_BYTES (32 << 20)
+
+// software encoders tried in order when none is given
+static const char *const sw_encoders[] = { "libx264", "libopenh264", "mpeg4", NULL };
 
-static int setup_hw()
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int setup_hw(TranscodeJob *job)
 {
     AVBufferRef *hw_frames_ref;
     AVHWFramesContext *frames_ctx = NULL;
     int ret = 0;
 
-    if ((ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0)) < 0) {
+    if ((ret = av_hwdevice_ctx_create(&job->hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0)) < 0) {
         fprintf(stderr, "Failed to create VAAPI device\n");
         return ret;
     }
 
-    if (!(hw_frames_ref = av_hwframe_ctx_alloc(hw_device_ctx))) {
+    if (!(hw_frames_ref = av_hwframe_ctx_alloc(job->hw_device_ctx))) {
         fprintf(stderr, "Failed to create VAAPI frame context\n");
         return -1;
     }
     frames_ctx = (AVHWFramesContext*)(hw_frames_ref->data);
     frames_ctx->format = AV_PIX_FMT_VAAPI;
     frames_ctx->sw_format = AV_PIX_FMT_NV12;
-    frames_ctx->width = enc_ctx->width;
-    frames_ctx->height = enc_ctx->height;
+    frames_ctx->width = job->enc_ctx->width;
+    frames_ctx->height = job->enc_ctx->height;
     frames_ctx->initial_pool_size = 20;
     if ((ret = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
         fprintf(stderr, "Failed to initialize VAAPI frame context\n");
@@ -44,79 +114,102 @@ static int setup_hw()
         return ret;
     }
 
-    enc_ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref);
-    if (!enc_ctx->hw_frames_ctx)
+    job->enc_ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref);
+    if (!job->enc_ctx->hw_frames_ctx)
         ret = AVERROR(ENOMEM);
 
     av_buffer_unref(&hw_frames_ref);
     return ret;
 }
 
-static int open_input_file(const char *filename)
+static int open_input_file(TranscodeJob *job)
 {
     int ret = 0;
 
-    if ((ret = avformat_open_input(&ifmt_ctx, filename, NULL, NULL)) < 0) {
-        fprintf(stderr, "Failed to open input\n");
+    if ((ret = avformat_open_input(&job->ifmt_ctx, job->input_file, NULL, NULL)) < 0) {
+        fprintf(stderr, "Failed to open input '%s'\n", job->input_file);
         return ret;
     }
 
-    if ((ret = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
+    if ((ret = avformat_find_stream_info(job->ifmt_ctx, NULL)) < 0) {
         fprintf(stderr, "Could not find stream info\n");
         return ret;
     }
 
     AVCodec *dec = NULL;
-    int idx = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+    int idx = av_find_best_stream(job->ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
     if (idx < 0) {
         fprintf(stderr, "No video stream found\n");
         return idx;
     }
 
-    dec_ctx = avcodec_alloc_context3(dec);
+    AVCodecContext *dec_ctx = job->dec_ctx = avcodec_alloc_context3(dec);
     if (!dec_ctx) {
         fprintf(stderr, "Failed to allocate decoder context\n");
         return AVERROR(ENOMEM);
     }
 
-    if ((ret = avcodec_parameters_to_context(dec_ctx, ifmt_ctx->streams[idx]->codecpar)) < 0) {
+    if ((ret = avcodec_parameters_to_context(dec_ctx, job->ifmt_ctx->streams[idx]->codecpar)) < 0) {
         fprintf(stderr, "Could not copy parameters to decoder context\n");
         return ret;
     }
 
-    dec_ctx->framerate = av_guess_frame_rate(ifmt_ctx, ifmt_ctx->streams[idx], NULL);
+    dec_ctx->framerate = av_guess_frame_rate(job->ifmt_ctx, job->ifmt_ctx->streams[idx], NULL);
+    // packets are sent in stream time base, decoded frames keep it
+    dec_ctx->pkt_timebase = job->ifmt_ctx->streams[idx]->time_base;
+    // frame threading where the decoder supports it, slices otherwise
+    dec_ctx->thread_count = job->nb_threads;
+    dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
     if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) {
         fprintf(stderr, "Failed to open decoder\n");
         return ret;
     }
 
-    av_dump_format(ifmt_ctx, idx, filename, 0);
+    job->video_stream_idx = idx;
+    av_dump_format(job->ifmt_ctx, idx, job->input_file, 0);
     return 0;
 }
 
-static int open_output_file(const char *filename)
+static AVCodec *find_encoder(void)
 {
-    int ret = 0;
-
-    // Force mp4 to use h264_vaapi encoder
-    if ((ret = avformat_alloc_output_context2(&ofmt_ctx, NULL, "mp4", filename)) < 0) {
-        fprintf(stderr, "Failed to allocate output context\n");
-        return ret;
+    if (use_hw) {
+        AVCodec *enc = avcodec_find_encoder_by_name("h264_vaapi");
+        if (!enc)
+            fprintf(stderr, "H264 (VAAPI) encoder not found\n");
+        return enc;
     }
 
-    AVCodec *enc = avcodec_find_encoder_by_name("h264_vaapi");
-    if (!enc) {
-        fprintf(stderr, "H264 (VAAPI) encoder not found\n");
-        return AVERROR_INVALIDDATA;
+    if (sw_encoder) {
+        AVCodec *enc = avcodec_find_encoder_by_name(sw_encoder);
+        if (!enc)
+            fprintf(stderr, "Encoder '%s' not found\n", sw_encoder);
+        return enc;
     }
 
-    AVStream *out_st = avformat_new_stream(ofmt_ctx, enc);
-    if (!out_st) {
-        fprintf(stderr, "Failed to allocate output stream\n");
-        return AVERROR(ENOMEM);
+    for (int i = 0; sw_encoders[i]; ++i) {
+        AVCodec *enc = avcodec_find_encoder_by_name(sw_encoders[i]);
+        if (enc)
+            return enc;
     }
+    fprintf(stderr, "No software encoder found\n");
+    return NULL;
+}
+
+/**
+ * Set up job->enc_ctx for the decoder output
+ * global_header: the muxer wants the codec headers as extradata
+ */
+static int open_encoder(TranscodeJob *job, int global_header)
+{
+    int ret = 0;
+    AVCodecContext *dec_ctx = job->dec_ctx;
 
-    enc_ctx = avcodec_alloc_context3(enc);
+    AVCodec *enc = find_encoder();
+    if (!enc)
+        return AVERROR_ENCODER_NOT_FOUND;
+
+    job->encoder_name = enc->name;
+    AVCodecContext *enc_ctx = job->enc_ctx = avcodec_alloc_context3(enc);
     if (!enc_ctx) {
         fprintf(stderr, "Failed to allocate encoder context\n");
         return AVERROR(ENOMEM);
@@ -125,12 +218,26 @@ static int open_output_file(const char *filename)
     enc_ctx->height = dec_ctx->height;
     enc_ctx->width = dec_ctx->width;
     enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-    enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
-    enc_ctx->pix_fmt = AV_PIX_FMT_VAAPI;
-    //enc_ctx->pix_fmt = AV_PIX_FMT_NV12;
-    setup_hw();
+    // some inputs have no frame rate, their timestamps are kept as they are
+    enc_ctx->time_base = dec_ctx->framerate.num ? av_inv_q(dec_ctx->framerate) : dec_ctx->pkt_timebase;
+    enc_ctx->framerate = dec_ctx->framerate;
+
+    if (use_hw) {
+        enc_ctx->pix_fmt = AV_PIX_FMT_VAAPI;
+        job->scale_fmt = AV_PIX_FMT_NV12;
+        if ((ret = setup_hw(job)) < 0)
+            return ret;
+    } else {
+        // closest format the encoder takes, NV12/YUV420P for the usual H.264 encoders
+        if (enc->pix_fmts)
+            enc_ctx->pix_fmt = avcodec_find_best_pix_fmt_of_list(enc->pix_fmts, dec_ctx->pix_fmt, 0, NULL);
+        else
+            enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        job->scale_fmt = enc_ctx->pix_fmt;
+        enc_ctx->thread_count = job->nb_threads;
+    }
 
-    if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    if (global_header)
         enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     if ((ret = avcodec_open2(enc_ctx, enc, NULL)) < 0) {
@@ -138,6 +245,29 @@ static int open_output_file(const char *filename)
         return ret;
     }
 
+    return 0;
+}
+
+static int open_output_file(TranscodeJob *job)
+{
+    int ret = 0;
+
+    if ((ret = avformat_alloc_output_context2(&job->ofmt_ctx, NULL, "mp4", job->output_file)) < 0) {
+        fprintf(stderr, "Failed to allocate output context\n");
+        return ret;
+    }
+    AVFormatContext *ofmt_ctx = job->ofmt_ctx;
+
+    if ((ret = open_encoder(job, ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)) < 0)
+        return ret;
+    AVCodecContext *enc_ctx = job->enc_ctx;
+
+    AVStream *out_st = avformat_new_stream(ofmt_ctx, enc_ctx->codec);
+    if (!out_st) {
+        fprintf(stderr, "Failed to allocate output stream\n");
+        return AVERROR(ENOMEM);
+    }
+
     if ((ret = avcodec_parameters_from_context(out_st->codecpar, enc_ctx)) < 0) {
         fprintf(stderr, "Could not copy parameters to output stream\n");
         return ret;
@@ -145,11 +275,11 @@ static int open_output_file(const char *filename)
 
     out_st->time_base = enc_ctx->time_base;
 
-    av_dump_format(ofmt_ctx, 0, filename, 1);
+    av_dump_format(ofmt_ctx, 0, job->output_file, 1);
 
     if (!(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        if ((ret = avio_open(&ofmt_ctx->pb, filename, AVIO_FLAG_WRITE)) < 0) {
-            fprintf(stderr, "Could not open output file '%s'", filename);
+        if ((ret = avio_open(&ofmt_ctx->pb, job->output_file, AVIO_FLAG_WRITE)) < 0) {
+            fprintf(stderr, "Could not open output file '%s'", job->output_file);
             return ret;
         }
     }
@@ -162,91 +292,773 @@ static int open_output_file(const char *filename)
     return 0;
 }
 
-static int scale_and_encode(AVFrame *input, AVFrame *output)
+/**
+ * Send a frame to the encoder (NULL to flush it) and mux every packet it returns
+ * In chunked mode the packets are kept in job->chunk_pkts instead
+ */
+static int encode_frame(TranscodeJob *job, AVFrame *frame)
 {
     int ret = 0;
+    AVPacket *pkt = job->enc_pkt;
 
-    sws_ctx = sws_getCachedContext(sws_ctx,
-                                   dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-                                   enc_ctx->width, enc_ctx->height, enc_ctx->pix_fmt,
-                                   SWS_BILINEAR, NULL, NULL, NULL);
-    if (!sws_ctx) {
-        fprintf(stderr, "Can't create scaler context for fmt:%s s:%dx%d -> fmt:%s s:%dx%d\n",
-                av_get_pix_fmt_name(dec_ctx->pix_fmt), dec_ctx->width, dec_ctx->height,
-                av_get_pix_fmt_name(enc_ctx->pix_fmt), enc_ctx->width, enc_ctx->height);
-        return AVERROR(EINVAL);
+    TRACE_BEGIN("encode");
+    ret = avcodec_send_frame(job->enc_ctx, frame);
+    TRACE_END("encode");
+    if (ret < 0) {
+        fprintf(stderr, "Error sending frame to encoder: %s\n", av_err2str(ret));
+        return ret;
     }
 
-    sws_scale(sws_ctx, (const uint8_t *const)input->data, (const int)input->linesize, 0,
-              input->height, output->data, output->linesize);
+    while (ret >= 0) {
+        TRACE_BEGIN("encode");
+        ret = avcodec_receive_packet(job->enc_ctx, pkt);
+        TRACE_END("encode");
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+            return ret;
 
-    return 0;
+        if (job->chunked) {
+            AVPacket *copy = av_packet_clone(pkt);
+            av_packet_unref(pkt);
+            if (!copy)
+                return AVERROR(ENOMEM);
+            if ((ret = av_dynarray_add_nofree(&job->chunk_pkts, &job->nb_chunk_pkts, copy)) < 0) {
+                av_packet_free(&copy);
+                return ret;
+            }
+            continue;
+        }
+
+        pkt->stream_index = 0;
+        av_packet_rescale_ts(pkt, job->enc_ctx->time_base, job->ofmt_ctx->streams[0]->time_base);
+        TRACE_BEGIN("mux");
+        ret = av_interleaved_write_frame(job->ofmt_ctx, pkt);
+        TRACE_END("mux");
+        av_packet_unref(pkt);
+        if (ret < 0) {
+            fprintf(stderr, "Error muxing packet: %s\n", av_err2str(ret));
+            return ret;
+        }
+    }
+
+    return ret;
+}
+
+static int scale_and_encode(TranscodeJob *job, AVFrame *input, AVFrame *output)
+{
+    int ret = 0;
+    AVCodecContext *enc_ctx = job->enc_ctx;
+    AVFrame *frame = input;
+    int64_t pts = input->best_effort_timestamp == AV_NOPTS_VALUE ? job->nb_frames_encoded :
+                  av_rescale_q(input->best_effort_timestamp, job->dec_ctx->pkt_timebase, enc_ctx->time_base);
+
+    if (input->format != job->scale_fmt || input->width != enc_ctx->width || input->height != enc_ctx->height) {
+        // the decoder only knows its output format for sure once it has produced a frame,
+        // and it can still change size or format mid-stream
+        if (job->scaler_ready && (input->width != job->scaler_w || input->height != job->scaler_h ||
+                                  input->format != job->scaler_fmt)) {
+            slice_scaler_uninit(&job->scaler);
+            job->scaler_ready = 0;
+        }
+        if (!job->scaler_ready) {
+            int nb_threads = job->nb_threads ? job->nb_threads : sysconf(_SC_NPROCESSORS_ONLN);
+            if ((ret = slice_scaler_init(&job->scaler, nb_threads,
+                                         input->width, input->height, input->format,
+                                         enc_ctx->width, enc_ctx->height, job->scale_fmt, SWS_BILINEAR)) < 0)
+                return ret;
+            job->scaler_ready = 1;
+            job->scaler_w = input->width;
+            job->scaler_h = input->height;
+            job->scaler_fmt = input->format;
+            printf("%s: scaling %s -> %s in %d band(s)\n", job->input_file, av_get_pix_fmt_name(input->format),
+                   av_get_pix_fmt_name(job->scale_fmt), job->scaler.nb_bands);
+        }
+
+        if ((ret = frame_pool_get(&job->out_pool, output, job->scale_fmt, enc_ctx->width, enc_ctx->height)) < 0)
+            return ret;
+
+        int64_t start = now_ns();
+        TRACE_BEGIN("scale");
+        ret = slice_scaler_scale(&job->scaler, input, output);
+        TRACE_END("scale");
+        job->scale_ns += now_ns() - start;
+        if (ret < 0) {
+            fprintf(stderr, "Error scaling frame: %s\n", av_err2str(ret));
+            return ret;
+        }
+        job->scale_bytes += av_image_get_buffer_size(input->format, input->width, input->height, 1) +
+                            av_image_get_buffer_size(output->format, output->width, output->height, 1);
+        frame = output;
+    } else {
+        // decoder output is what the encoder takes, hand it over as it is
+        ++job->nb_frames_passthrough;
+    }
+
+    frame->pts = pts;
+    // the decoded picture type would force the input GOP structure on the encoder
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+    if (use_hw) {
+        AVFrame *hw_frame = job->hw_frame;
+        if ((ret = av_hwframe_get_buffer(enc_ctx->hw_frames_ctx, hw_frame, 0)) < 0) {
+            fprintf(stderr, "Failed to get a VAAPI surface: %s\n", av_err2str(ret));
+            return ret;
+        }
+        TRACE_BEGIN("upload");
+        ret = av_hwframe_transfer_data(hw_frame, frame, 0);
+        TRACE_END("upload");
+        if (ret < 0) {
+            fprintf(stderr, "Failed to upload frame: %s\n", av_err2str(ret));
+            av_frame_unref(hw_frame);
+            return ret;
+        }
+        hw_frame->pts = frame->pts;
+        ret = encode_frame(job, hw_frame);
+        av_frame_unref(hw_frame);
+    } else {
+        ret = encode_frame(job, frame);
+    }
+
+    if (ret >= 0)
+        ++job->nb_frames_encoded;
+    return ret;
 }
 
 /**
- * Grab frame from input file
- * Software convert to NV12 format
- * Hardware encode the scaled frame
+ * Send a packet to the decoder (NULL to drain it) and process every frame it returns
+ * job->in_frame and job->out_frame are reused, they're blank when this returns
  */
-int main(int argc, char *argv[])
+static int decode_packet(TranscodeJob *job, AVPacket *pkt)
 {
     int ret = 0;
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input_file> <output_file>\n"
-                "Example to show how to convert formats in software and hardware encode\n", argv[0]);
-        exit(0);
+    TRACE_BEGIN("decode");
+    ret = avcodec_send_packet(job->dec_ctx, pkt);
+    TRACE_END("decode");
+    if (ret < 0) {
+        fprintf(stderr, "Error sending packet to decoder: %s\n", av_err2str(ret));
+        return ret;
     }
 
-    const char *input_file = argv[1];
-    const char *output_file = argv[2];
+    while (ret >= 0) {
+        TRACE_BEGIN("decode");
+        ret = avcodec_receive_frame(job->dec_ctx, job->in_frame);
+        TRACE_END("decode");
+        if (ret == AVERROR(EAGAIN))
+            return 0;
+        if (ret < 0)
+            return ret;
 
-    av_register_all();
-    avcodec_register_all();
-    avdevice_register_all();
-    av_log_set_level(AV_LOG_VERBOSE);
+        // pictures of the neighbouring chunks, decoded as references only
+        int64_t ts = job->in_frame->best_effort_timestamp;
+        if (job->chunked && ts != AV_NOPTS_VALUE && (ts < job->chunk_start_pts || ts >= job->chunk_end_pts)) {
+            av_frame_unref(job->in_frame);
+            continue;
+        }
+
+        ret = scale_and_encode(job, job->in_frame, job->out_frame);
+        av_frame_unref(job->in_frame);
+        av_frame_unref(job->out_frame);
+    }
+
+    return ret;
+}
+
+static void close_job(TranscodeJob *job)
+{
+    av_frame_free(&job->in_frame);
+    av_frame_free(&job->out_frame);
+    av_frame_free(&job->hw_frame);
+    av_packet_free(&job->enc_pkt);
+    avcodec_free_context(&job->enc_ctx);
+    avcodec_free_context(&job->dec_ctx);
+    av_buffer_unref(&job->hw_device_ctx);
+    read_ahead_stop(&job->read_ahead);
+    avformat_close_input(&job->ifmt_ctx);
+    if (job->ofmt_ctx && !(job->ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&job->ofmt_ctx->pb);
+    avformat_free_context(job->ofmt_ctx);
+    job->ofmt_ctx = NULL;
+    if (job->scaler_ready)
+        slice_scaler_uninit(&job->scaler);
+    job->scaler_ready = 0;
+    frame_pool_uninit(&job->out_pool);
+}
+
+/**
+ * Decode, convert and encode the whole input, the result is also left in job->ret
+ * A chunked job only does its range of the input and keeps the packets, it writes no file
+ */
+static int run_job(TranscodeJob *job)
+{
+    int ret = 0;
+    AVPacket pkt = { .data = NULL, .size = 0 };
+    int64_t start = now_ns();
+
+    job->video_stream_idx = -1;
+    job->scale_fmt = AV_PIX_FMT_NONE;
 
-    if (open_input_file(input_file) < 0)
+    if ((ret = open_input_file(job)) < 0)
         goto end;
-    if (open_output_file(output_file) < 0)
+    if ((ret = job->chunked ? open_encoder(job, job->global_header) : open_output_file(job)) < 0)
         goto end;
 
-    AVPacket pkt = { .data = NULL, .size = 0 };
-    AVFrame *in_frame, *out_frame;
-    while ((ret = av_read_frame(ifmt_ctx, &pkt)) >= 0) {
-        int idx = pkt.stream_index;
-        int got_frame;
-        in_frame = av_frame_alloc();
-        out_frame = av_frame_alloc();
-        if (!in_frame || !out_frame) {
-            fprintf(stderr, "Failed to allocate frame\n");
-            ret = AVERROR(ENOMEM);
-            goto end;
+    job->in_frame = av_frame_alloc();
+    job->out_frame = av_frame_alloc();
+    job->hw_frame = av_frame_alloc();
+    job->enc_pkt = av_packet_alloc();
+    if (!job->in_frame || !job->out_frame || !job->hw_frame || !job->enc_pkt) {
+        fprintf(stderr, "Failed to allocate frame\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    // lands on the keyframe starting the chunk or one before
+    if (job->chunked && job->chunk_start_dts != INT64_MIN &&
+        (ret = av_seek_frame(job->ifmt_ctx, job->video_stream_idx, job->chunk_start_dts, AVSEEK_FLAG_BACKWARD)) < 0) {
+        fprintf(stderr, "Failed to seek to the start of the chunk: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    if ((ret = read_ahead_init(&job->read_ahead, job->ifmt_ctx, READ_AHEAD_PKTS, READ_AHEAD_BYTES)) < 0)
+        goto end;
+    job->read_ahead.stream_index = job->video_stream_idx;
+    if ((ret = read_ahead_start(&job->read_ahead)) < 0) {
+        fprintf(stderr, "Failed to start the read-ahead thread\n");
+        goto end;
+    }
+
+    int past_end = 0;
+    while ((ret = read_ahead_pop(&job->read_ahead, &pkt, NULL, 0)) >= 0) {
+        if (job->chunked && pkt.dts != AV_NOPTS_VALUE && pkt.dts < job->chunk_start_dts) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+        if (job->chunked) {
+            // from the next chunk's keyframe on, only what's displayed before it (open GOP leading pictures)
+            if (pkt.dts != AV_NOPTS_VALUE && pkt.dts >= job->chunk_end_dts)
+                past_end = 1;
+            if (past_end && (pkt.pts == AV_NOPTS_VALUE || pkt.pts > job->chunk_end_pts)) {
+                av_packet_unref(&pkt);
+                ret = AVERROR_EOF;
+                break;
+            }
         }
-        av_packet_rescale_ts(&pkt, ifmt_ctx->streams[idx]->time_base, dec_ctx->time_base);
-        if ((ret = avcodec_decode_video2(dec_ctx, in_frame, &got_frame, &pkt)) < 0) {
+
+        ret = decode_packet(job, &pkt);
+        av_packet_unref(&pkt);
+        if (ret < 0)
             goto end;
+    }
+    if (ret != AVERROR_EOF)
+        goto end;
+
+    // flush the frames still buffered in the decoder (frame threading holds one per thread)
+    if ((ret = decode_packet(job, NULL)) != AVERROR_EOF)
+        goto end;
+    // and the ones the encoder holds back for lookahead / B-frames
+    if ((ret = encode_frame(job, NULL)) < 0)
+        goto end;
+    if (!job->chunked && (ret = av_write_trailer(job->ofmt_ctx)) < 0)
+        fprintf(stderr, "Error writing trailer\n");
+
+end:
+    job->wall_ns = now_ns() - start;
+    close_job(job);
+    job->ret = ret;
+    return ret;
+}
+
+static void print_cpu_usage(int64_t wall_ns)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    double wall = wall_ns / 1e9;
+
+    printf("CPU: %.3fs user, %.3fs sys, %.2f cores busy on average\n", user, sys,
+           wall > 0 ? (user + sys) / wall : 0.0);
+}
+
+static void print_job_stats(const TranscodeJob *job)
+{
+    double wall = job->wall_ns / 1e9;
+
+    printf("%s -> %s: %"PRId64" frames in %.3fs, %.2f fps\n", job->input_file, job->output_file,
+           job->nb_frames_encoded, wall, wall > 0 ? job->nb_frames_encoded / wall : 0.0);
+    printf("%"PRId64" frames passed through, %"PRId64" converted\n", job->nb_frames_passthrough,
+           job->nb_frames_encoded - job->nb_frames_passthrough);
+    if (job->nb_frames_encoded) {
+        printf("Scaling: %.3f ms/frame, %.2f MB/frame of conversion traffic\n",
+               job->scale_ns / 1e6 / job->nb_frames_encoded, job->scale_bytes / 1e6 / job->nb_frames_encoded);
+        frame_pool_print_stats(&job->out_pool, "Output frame pool");
+    }
+    printf("Read-ahead: %"PRId64" packets, decoder waited on input %"PRId64" times, ring full %"PRId64" times\n",
+           job->read_ahead.nb_pkts, job->read_ahead.nb_underruns, job->read_ahead.nb_full);
+}
+
+typedef struct Batch {
+    TranscodeJob *jobs;
+    int nb_jobs;
+    pthread_mutex_t print_lock;
+} Batch;
+
+static void batch_run_job(void *opaque, int task, int worker)
+{
+    Batch *b = opaque;
+    TranscodeJob *job = &b->jobs[task];
+    char name[32];
+
+    snprintf(name, sizeof(name), "worker %d", worker);
+    trace_thread_name(name);
+    run_job(job);
+
+    pthread_mutex_lock(&b->print_lock);
+    printf("[job %d, worker %d] ", task, worker);
+    if (job->ret < 0)
+        printf("%s failed: %s\n", job->input_file, av_err2str(job->ret));
+    else
+        print_job_stats(job);
+    pthread_mutex_unlock(&b->print_lock);
+}
+
+/**
+ * Read "<input_file> <output_file>" pairs, one per line, blank lines and # comments are skipped
+ * Paths can't contain whitespace
+ */
+static int read_manifest(const char *filename, Batch *b)
+{
+    char line[4096], input[2048], output[2048];
+    int ret = 0;
+
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open manifest '%s'\n", filename);
+        return AVERROR(errno);
+    }
+
+    for (int lineno = 1; fgets(line, sizeof(line), f); ++lineno) {
+        char first[2];
+        if (sscanf(line, " %1s", first) != 1 || first[0] == '#')
+            continue;
+        if (sscanf(line, " %2047s %2047s", input, output) != 2) {
+            fprintf(stderr, "%s:%d: expected <input_file> <output_file>\n", filename, lineno);
+            ret = AVERROR_INVALIDDATA;
+            break;
+        }
+
+        TranscodeJob *jobs = av_realloc_array(b->jobs, b->nb_jobs + 1, sizeof(*jobs));
+        if (!jobs) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        b->jobs = jobs;
+        memset(&jobs[b->nb_jobs], 0, sizeof(*jobs));
+        jobs[b->nb_jobs].input_file = av_strdup(input);
+        jobs[b->nb_jobs].output_file = av_strdup(output);
+        if (!jobs[b->nb_jobs].input_file || !jobs[b->nb_jobs].output_file)
+            ret = AVERROR(ENOMEM);
+        ++b->nb_jobs;
+        if (ret < 0)
+            break;
+    }
+
+    fclose(f);
+    return ret;
+}
+
+static int run_batch(const char *manifest, int nb_workers, int nb_threads)
+{
+    Batch b = { 0 };
+    int nb_failed = 0, nb_steals = 0;
+    int64_t nb_frames = 0;
+    int ret = 0;
+
+    if ((ret = read_manifest(manifest, &b)) < 0)
+        goto end;
+    if (!b.nb_jobs) {
+        fprintf(stderr, "Manifest '%s' has no jobs\n", manifest);
+        goto end;
+    }
+
+    int nb_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_workers <= 0)
+        nb_workers = nb_cores;
+    nb_workers = FFMIN(nb_workers, b.nb_jobs);
+    // split the cores between the jobs running at once instead of every codec starting one thread per core
+    if (nb_threads <= 0)
+        nb_threads = FFMAX(nb_cores / nb_workers, 1);
+    for (int i = 0; i < b.nb_jobs; ++i)
+        b.jobs[i].nb_threads = nb_threads;
+
+    printf("%d jobs on %d workers, %d thread(s) per job\n", b.nb_jobs, nb_workers, nb_threads);
+
+    pthread_mutex_init(&b.print_lock, NULL);
+    int64_t start = now_ns();
+    ret = work_pool_run(nb_workers, b.nb_jobs, batch_run_job, &b, &nb_steals);
+    int64_t wall_ns = now_ns() - start;
+    pthread_mutex_destroy(&b.print_lock);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < b.nb_jobs; ++i) {
+        nb_failed += b.jobs[i].ret < 0;
+        nb_frames += b.jobs[i].nb_frames_encoded;
+    }
+    printf("%d jobs done, %d failed, %d stolen\n", b.nb_jobs - nb_failed, nb_failed, nb_steals);
+    printf("%"PRId64" frames in %.3fs, %.2f fps aggregate\n", nb_frames, wall_ns / 1e9,
+           wall_ns ? nb_frames / (wall_ns / 1e9) : 0.0);
+    print_cpu_usage(wall_ns);
+    if (nb_failed)
+        ret = AVERROR(EIO);
+
+end:
+    for (int i = 0; i < b.nb_jobs; ++i) {
+        av_freep(&b.jobs[i].input_file);
+        av_freep(&b.jobs[i].output_file);
+    }
+    av_freep(&b.jobs);
+    return ret;
+}
+
+/**
+ * Chunked mode
+ *
+ * The input is split at keyframes into ranges that are decoded, converted and
+ * encoded as separate jobs with their own decoder and encoder, on the work pool.
+ * Each finished chunk is appended to the one output in input order, so only the
+ * packets of chunks that finished ahead of an earlier one wait in memory.
+ * The output GOPs start where the chunks do.
+ */
+typedef struct Chunked {
+    TranscodeJob master; // owns the muxer, its encoder only provides the stream parameters
+    TranscodeJob *chunks;
+    int nb_chunks;
+    int next_write;
+    int64_t last_dts; // output time base
+    int nb_fixups;
+    int failed;
+    pthread_mutex_t mux_lock;
+} Chunked;
+
+typedef struct KeyFrame {
+    int64_t dts;
+    int64_t pts;
+    int index; // among the video packets
+} KeyFrame;
+
+/**
+ * Read the video packets of the master input and split them at keyframes into at
+ * most nb_chunks chunks of about the same number of packets
+ */
+static int plan_chunks(Chunked *c, int nb_chunks)
+{
+    AVPacket pkt = { .data = NULL, .size = 0 };
+    KeyFrame *keys = NULL;
+    int nb_keys = 0, keys_size = 0;
+    int nb_pkts = 0;
+    int ret = 0;
+
+    while ((ret = av_read_frame(c->master.ifmt_ctx, &pkt)) >= 0) {
+        if (pkt.stream_index == c->master.video_stream_idx) {
+            // a boundary needs both timestamps to place the packets and the frames
+            if (pkt.flags & AV_PKT_FLAG_KEY && pkt.dts != AV_NOPTS_VALUE && pkt.pts != AV_NOPTS_VALUE) {
+                if (nb_keys == keys_size) {
+                    keys_size = FFMAX(2 * keys_size, 64);
+                    KeyFrame *k = av_realloc_array(keys, keys_size, sizeof(*keys));
+                    if (!k) {
+                        av_packet_unref(&pkt);
+                        ret = AVERROR(ENOMEM);
+                        goto end;
+                    }
+                    keys = k;
+                }
+                keys[nb_keys++] = (KeyFrame){ .dts = pkt.dts, .pts = pkt.pts, .index = nb_pkts };
+            }
+            ++nb_pkts;
         }
+        av_packet_unref(&pkt);
+    }
+    if (ret != AVERROR_EOF)
+        goto end;
+    ret = 0;
+
+    c->chunks = av_mallocz_array(FFMAX(FFMIN(nb_chunks, nb_keys), 1), sizeof(*c->chunks));
+    if (!c->chunks) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    // the first chunk also takes whatever comes before the first keyframe
+    int target = (nb_pkts + nb_chunks - 1) / FFMAX(nb_chunks, 1);
+    int start_index = 0;
+    c->nb_chunks = 1;
+    c->chunks[0].chunk_start_dts = c->chunks[0].chunk_start_pts = INT64_MIN;
+    for (int k = 1; k < nb_keys && c->nb_chunks < nb_chunks; ++k) {
+        if (keys[k].index - start_index < target)
+            continue;
+        TranscodeJob *prev = &c->chunks[c->nb_chunks - 1];
+        TranscodeJob *next = &c->chunks[c->nb_chunks++];
+        prev->chunk_end_dts = next->chunk_start_dts = keys[k].dts;
+        prev->chunk_end_pts = next->chunk_start_pts = keys[k].pts;
+        start_index = keys[k].index;
+    }
+    c->chunks[c->nb_chunks - 1].chunk_end_dts = c->chunks[c->nb_chunks - 1].chunk_end_pts = INT64_MAX;
 
-        if (got_frame) {
-            if ((ret = scale_and_encode(in_frame, out_frame)) < 0) {
-                goto end;
+    printf("%s: %d video packets, %d keyframes, %d chunk(s)\n", c->master.input_file, nb_pkts, nb_keys, c->nb_chunks);
+
+end:
+    av_free(keys);
+    return ret;
+}
+
+/**
+ * Append every finished chunk that follows the ones already written, called with mux_lock held
+ */
+static void write_chunks(Chunked *c)
+{
+    AVFormatContext *ofmt_ctx = c->master.ofmt_ctx;
+
+    while (c->next_write < c->nb_chunks && c->chunks[c->next_write].chunk_done) {
+        TranscodeJob *job = &c->chunks[c->next_write++];
+        if (job->ret < 0)
+            c->failed = 1;
+
+        for (int i = 0; i < job->nb_chunk_pkts; ++i) {
+            AVPacket *pkt = job->chunk_pkts[i];
+            if (!c->failed) {
+                pkt->stream_index = 0;
+                av_packet_rescale_ts(pkt, c->master.enc_ctx->time_base, ofmt_ctx->streams[0]->time_base);
+                // every chunk restarts the encoder delay, the joins must still have increasing dts
+                if (c->last_dts != AV_NOPTS_VALUE && pkt->dts <= c->last_dts) {
+                    pkt->dts = c->last_dts + 1;
+                    pkt->pts = FFMAX(pkt->pts, pkt->dts);
+                    ++c->nb_fixups;
+                }
+                c->last_dts = pkt->dts;
+                TRACE_BEGIN("mux");
+                int ret = av_interleaved_write_frame(ofmt_ctx, pkt);
+                TRACE_END("mux");
+                if (ret < 0) {
+                    fprintf(stderr, "Error muxing packet: %s\n", av_err2str(ret));
+                    job->ret = ret;
+                    c->failed = 1;
+                }
             }
-        } else {
-            av_frame_free(&in_frame);
+            av_packet_free(&job->chunk_pkts[i]);
         }
+        av_freep(&job->chunk_pkts);
+        job->nb_chunk_pkts = 0;
+    }
+}
+
+static void chunk_run_job(void *opaque, int task, int worker)
+{
+    Chunked *c = opaque;
+    TranscodeJob *job = &c->chunks[task];
+    char name[32];
+
+    snprintf(name, sizeof(name), "worker %d", worker);
+    trace_thread_name(name);
+    pthread_mutex_lock(&c->mux_lock);
+    int failed = c->failed;
+    pthread_mutex_unlock(&c->mux_lock);
+
+    // no point in encoding what can't be written any more
+    if (failed)
+        job->ret = AVERROR_EXIT;
+    else
+        run_job(job);
+
+    pthread_mutex_lock(&c->mux_lock);
+    if (job->ret < 0 && job->ret != AVERROR_EXIT) {
+        printf("[chunk %d, worker %d] failed: %s\n", task, worker, av_err2str(job->ret));
+        c->failed = 1;
+    }
+    job->chunk_done = 1;
+    write_chunks(c);
+    pthread_mutex_unlock(&c->mux_lock);
+}
+
+static int run_chunked(const char *input_file, const char *output_file, int nb_workers, int nb_threads, int nb_chunks)
+{
+    Chunked c = { .master = { .input_file = input_file, .output_file = output_file, .nb_threads = 1 },
+                  .last_dts = AV_NOPTS_VALUE };
+    int64_t nb_frames = 0, scale_ns = 0;
+    int nb_steals = 0;
+    int ret = 0;
+
+    c.master.video_stream_idx = -1;
+    c.master.scale_fmt = AV_PIX_FMT_NONE;
+    if ((ret = open_input_file(&c.master)) < 0 || (ret = open_output_file(&c.master)) < 0)
+        goto end;
+
+    int nb_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_workers <= 0)
+        nb_workers = nb_cores;
+    // a few chunks per worker so the stealing evens out chunks of different cost
+    if (nb_chunks <= 0)
+        nb_chunks = 4 * nb_workers;
+    if ((ret = plan_chunks(&c, nb_chunks)) < 0)
+        goto end;
+    nb_workers = FFMIN(nb_workers, c.nb_chunks);
+    if (nb_threads <= 0)
+        nb_threads = FFMAX(nb_cores / nb_workers, 1);
+
+    for (int i = 0; i < c.nb_chunks; ++i) {
+        TranscodeJob *job = &c.chunks[i];
+        job->input_file = input_file;
+        job->output_file = output_file;
+        job->nb_threads = nb_threads;
+        job->chunked = 1;
+        job->global_header = !!(c.master.enc_ctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER);
+    }
+    printf("%d chunks on %d workers, %d thread(s) per chunk\n", c.nb_chunks, nb_workers, nb_threads);
+
+    pthread_mutex_init(&c.mux_lock, NULL);
+    int64_t start = now_ns();
+    ret = work_pool_run(nb_workers, c.nb_chunks, chunk_run_job, &c, &nb_steals);
+    int64_t wall_ns = now_ns() - start;
+    pthread_mutex_destroy(&c.mux_lock);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < c.nb_chunks; ++i) {
+        // report the chunk that failed rather than the ones skipped after it
+        if (c.chunks[i].ret < 0 && (ret >= 0 || ret == AVERROR_EXIT))
+            ret = c.chunks[i].ret;
+        nb_frames += c.chunks[i].nb_frames_encoded;
+        scale_ns += c.chunks[i].scale_ns;
     }
+    if (ret < 0)
+        goto end;
+    if ((ret = av_write_trailer(c.master.ofmt_ctx)) < 0) {
+        fprintf(stderr, "Error writing trailer\n");
+        goto end;
+    }
+
+    printf("%s encode (%s), %d chunks, %d stolen, %d dts fixed at the joins\n", use_hw ? "VAAPI" : "Software",
+           c.master.encoder_name, c.nb_chunks, nb_steals, c.nb_fixups);
+    printf("%s -> %s: %"PRId64" frames in %.3fs, %.2f fps\n", input_file, output_file, nb_frames, wall_ns / 1e9,
+           wall_ns ? nb_frames / (wall_ns / 1e9) : 0.0);
+    if (nb_frames)
+        printf("Scaling: %.3f ms/frame\n", scale_ns / 1e6 / nb_frames);
+    print_cpu_usage(wall_ns);
 
 end:
-    avcodec_free_context(&enc_ctx);
-    avcodec_free_context(&dec_ctx);
-    av_buffer_unref(&hw_device_ctx);
-    avformat_close_input(&ifmt_ctx);
-    avformat_free_context(ifmt_ctx);
-    if (ofmt_ctx && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&ofmt_ctx->pb);
-    avformat_free_context(ofmt_ctx);
-    sws_freeContext(sws_ctx);
+    for (int i = 0; i < c.nb_chunks; ++i) {
+        for (int j = 0; j < c.chunks[i].nb_chunk_pkts; ++j)
+            av_packet_free(&c.chunks[i].chunk_pkts[j]);
+        av_freep(&c.chunks[i].chunk_pkts);
+    }
+    av_freep(&c.chunks);
+    close_job(&c.master);
+    return ret;
+}
+
+/**
+ * Grab frame from input file
+ * Software convert to NV12 format (or whatever the software encoder takes)
+ * Hardware encode the scaled frame, or software encode it with -e sw
+ * With -b, transcode every pair listed in a manifest on a pool of workers
+ * With -g, split the input at keyframes and transcode the chunks on a pool of workers
+ */
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    int nb_threads = 0;
+    int nb_workers = 0;
+    int nb_chunks = -1;
+    const char *manifest = NULL;
+    const char *trace_file = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:c:t:b:j:g:T:")) != -1) {
+        switch (opt) {
+        case 'e':
+            if (!strcmp(optarg, "vaapi")) {
+                use_hw = 1;
+            } else if (!strcmp(optarg, "sw")) {
+                use_hw = 0;
+            } else {
+                fprintf(stderr, "Unknown encode path '%s', expected vaapi or sw\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            sw_encoder = optarg;
+            use_hw = 0;
+            break;
+        case 't':
+            nb_threads = atoi(optarg);
+            break;
+        case 'b':
+            manifest = optarg;
+            break;
+        case 'j':
+            nb_workers = atoi(optarg);
+            break;
+        case 'g':
+            nb_chunks = atoi(optarg);
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc - optind != (manifest ? 0 : 2)) {
+        fprintf(stderr, "Usage: %s [-e vaapi|sw] [-c encoder] [-t threads] [-j workers -g chunks] [-T trace.json] <input_file> <output_file>\n"
+                "       %s [-e vaapi|sw] [-c encoder] [-t threads] [-j workers] [-T trace.json] -b <manifest>\n"
+                "Example to show how to convert formats in software and hardware encode\n"
+                "  -e  encode with VAAPI (default) or in software\n"
+                "  -c  software encoder, implies -e sw (default: first of libx264, libopenh264, mpeg4)\n"
+                "  -t  decoder/encoder/scaler threads per job (default: one per core, split between workers in batch mode)\n"
+                "  -b  manifest of '<input_file> <output_file>' lines to transcode in a batch\n"
+                "  -j  jobs or chunks running at once in batch or chunked mode (default: one per core)\n"
+                "  -g  split the input at keyframes into about this many chunks transcoded in parallel,\n"
+                "      0 for 4 per worker\n"
+                "  -T  write a timeline of the decode, scale, encode and mux calls of every thread,\n"
+                "      open it in chrome://tracing or ui.perfetto.dev\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    av_register_all();
+    avcodec_register_all();
+    avdevice_register_all();
+
+    if (trace_file) {
+        trace_start();
+        trace_thread_name("main");
+    }
+
+    if (manifest) {
+        // the per-file format dumps of a whole batch would bury the results
+        av_log_set_level(AV_LOG_WARNING);
+        ret = run_batch(manifest, nb_workers, nb_threads);
+    } else if (nb_chunks >= 0) {
+        // one format dump per chunk otherwise
+        av_log_set_level(AV_LOG_WARNING);
+        ret = run_chunked(argv[optind], argv[optind + 1], nb_workers, nb_threads, nb_chunks);
+    } else {
+        TranscodeJob job = { .input_file = argv[optind], .output_file = argv[optind + 1], .nb_threads = nb_threads };
+        av_log_set_level(AV_LOG_VERBOSE);
+        int64_t start = now_ns();
+        if ((ret = run_job(&job)) >= 0) {
+            printf("%s encode (%s)\n", use_hw ? "VAAPI" : "Software", job.encoder_name);
+            print_job_stats(&job);
+            print_cpu_usage(now_ns() - start);
+        }
+    }
+
+    // the work pool threads were joined by work_pool_run()
+    if (trace_file)
+        trace_finish(trace_file);
 
     if (ret < 0)
         fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
@@ -5,9 +5,13 @@
 #include <libavutil/frame.h>
 #include <libavutil/md5.h>
 #include <libavutil/opt.h>
-#include <math.h>
+#include <libavutil/time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "filter_stats.h"
+#include "tone_gen.h"
 
 static const enum AVSampleFormat format = AV_SAMPLE_FMT_S16;
 static const int nb_samples = 1024;
@@ -17,22 +21,65 @@ static const int sample_rate = 44100;
 static AVFilterContext *buffersrc_ctx, *buffersink_ctx;
 static AVFilterGraph *graph;
 static AVFilterInOut *outputs, *inputs;
+static ToneGen tone;
+static FilterStats graph_stats;
+
+// streaming mode, latencies are matched to input frames through pts
+#define LATENCY_RING 4096
+
+typedef struct StreamStats {
+    int64_t frames_in;
+    int64_t samples_in;
+    int64_t frames_out;
+    int64_t samples_out;
+    int64_t push_time[LATENCY_RING]; // av_gettime_relative() when input frame n was pushed
+    int64_t latency_sum;
+    int64_t latency_max;
+} StreamStats;
 
-static void fill_samples(uint16_t* samples, int sampleRate, int nbSamples, int nbChannels, float tone)
+static int fill_samples(AVFrame *frame)
 {
-    const float pi = 3.14159265358979323846264338327950288;
-    const float tincr = 2 * pi * tone / sampleRate;
-    float t = 0;
-
-    for (int i = 0; i < 200; ++i) {
-        for (int j = 0; j < nbSamples; ++j) {
-            samples[2 * j] = (int)(sin(t) * 10000);
-            for (int k = 1; k < nbChannels; ++k) {
-                samples[2 * j + k] = samples[2 * j];
-            }
-            t += tincr;
-        }
+    int ret = tone_gen_fill_frame(&tone, frame);
+    if (ret < 0)
+        printf("Can't generate %s samples: %s\n", av_get_sample_fmt_name(frame->format), av_err2str(ret));
+    return ret;
+}
+
+/**
+ * Synthesize seconds of a tone as fast as possible and report the speed
+ */
+static int tone_benchmark(double seconds, int channels, enum AVSampleFormat sample_fmt)
+{
+    int ret = 0;
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return AVERROR(ENOMEM);
+
+    frame->format = sample_fmt;
+    frame->channel_layout = av_get_default_channel_layout(channels);
+    frame->channels = channels;
+    frame->nb_samples = nb_samples;
+    frame->sample_rate = sample_rate;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+        printf("Failed to allocate frame buffer: %s\n", av_err2str(ret));
+        goto end;
     }
+
+    tone_gen_init(&tone, 440.0, sample_rate, 0.5f);
+    int64_t nb_frames = seconds * sample_rate / nb_samples;
+    int64_t start = av_gettime_relative();
+    for (int64_t i = 0; i < nb_frames; ++i)
+        if ((ret = fill_samples(frame)) < 0)
+            goto end;
+    int64_t elapsed = FFMAX(av_gettime_relative() - start, 1);
+
+    double generated = (double)nb_frames * nb_samples / sample_rate;
+    printf("Generated %.0f s of %d channel %s in %.3f s, %.0fx realtime\n", generated, channels,
+           av_get_sample_fmt_name(sample_fmt), elapsed / 1000000.0, generated * 1000000.0 / elapsed);
+
+end:
+    av_frame_free(&frame);
+    return ret;
 }
 
 static int init_filters(const char *spec)
@@ -51,7 +98,7 @@ static int init_filters(const char *spec)
     char args[512];
     snprintf(args, sizeof(args),
              "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
-             1, 1, sample_rate, av_get_sample_fmt_name(format), channel_layout);
+             1, sample_rate, sample_rate, av_get_sample_fmt_name(format), channel_layout);
 
     const AVFilter* buffersrc = avfilter_get_by_name("abuffer");
     const AVFilter* buffersink = avfilter_get_by_name("abuffersink");
@@ -109,6 +156,8 @@ static int init_filters(const char *spec)
         goto end;
     }
 
+    ret = filter_stats_init(&graph_stats, graph, 0);
+
 end:
     return ret;
 }
@@ -116,35 +165,138 @@ end:
 static int apply_filters(AVFrame *frame)
 {
     int ret = 0;
-    AVFrame* filtered = NULL;
+    AVFrame* filtered = av_frame_alloc();
+    if (!filtered)
+        return AVERROR(ENOMEM);
 
-    if ((ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, 0)) < 0) {
+    if ((ret = filter_stats_add_frame(&graph_stats, buffersrc_ctx, frame, 0)) < 0) {
         printf("Error feeding filter chain: %s\n", av_err2str(ret));
         goto end;
     }
 
     while (ret >= 0) {
-        filtered = av_frame_alloc();
-        if (!filtered) {
-            ret = AVERROR(ENOMEM);
-            break;
-        }
-
-        if ((ret = av_buffersink_get_frame(buffersink_ctx, filtered)) < 0) {
+        if ((ret = filter_stats_get_frame(&graph_stats, buffersink_ctx, filtered, 0)) < 0) {
             // not an error
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
                 ret = 0;
-
-            av_frame_free(&filtered);
             break;
         }
 
         // move filtered frame into frame, so caller can access it
         av_frame_unref(frame);
         av_frame_move_ref(frame, filtered);
-        //av_frame_free(&filtered);
     }
 end:
+    av_frame_free(&filtered);
+    return ret;
+}
+
+/**
+ * Pull everything the graph has ready into the reused output frame
+ * Returns AVERROR_EOF once the sink is drained after EOF
+ */
+static int drain_filters(AVFrame *filtered, StreamStats *stats)
+{
+    int ret = 0;
+    const AVRational in_tb = { 1, sample_rate };
+    const AVRational out_tb = av_buffersink_get_time_base(buffersink_ctx);
+
+    while ((ret = filter_stats_get_frame(&graph_stats, buffersink_ctx, filtered, 0)) >= 0) {
+        int64_t now = av_gettime_relative();
+        ++stats->frames_out;
+        stats->samples_out += filtered->nb_samples;
+
+        // latency from pushing the input frame holding the first output sample
+        if (filtered->pts != AV_NOPTS_VALUE) {
+            int64_t index = av_rescale_q(filtered->pts, out_tb, in_tb) / nb_samples;
+            if (index >= 0 && index < stats->frames_in && stats->frames_in - index <= LATENCY_RING) {
+                int64_t latency = now - stats->push_time[index % LATENCY_RING];
+                stats->latency_sum += latency;
+                stats->latency_max = FFMAX(stats->latency_max, latency);
+            }
+        }
+        av_frame_unref(filtered);
+    }
+
+    if (ret == AVERROR(EAGAIN))
+        return 0;
+    if (ret != AVERROR_EOF)
+        printf("Error pulling from filter chain: %s\n", av_err2str(ret));
+    return ret;
+}
+
+/**
+ * Push nb_frames generated frames through the graph and drain it
+ * One input and one output frame are reused for the whole run
+ */
+static int stream_filters(int nb_frames)
+{
+    int ret = 0;
+    StreamStats *stats = av_mallocz(sizeof(*stats));
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *filtered = av_frame_alloc();
+    if (!stats || !frame || !filtered) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    frame->format = format;
+    frame->channel_layout = channel_layout;
+    frame->nb_samples = nb_samples;
+    frame->sample_rate = sample_rate;
+    frame->channels = av_get_channel_layout_nb_channels(channel_layout);
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+        printf("Failed to allocate frame buffer: %s\n", av_err2str(ret));
+        goto end;
+    }
+    tone_gen_init(&tone, 440.0, sample_rate, 10000.0f / 32767);
+
+    int64_t start = av_gettime_relative();
+    for (int i = 0; i < nb_frames; ++i) {
+        // only copies if the graph still holds the previous samples (e.g. atrim passes frames through)
+        if ((ret = av_frame_make_writable(frame)) < 0)
+            goto end;
+        if ((ret = fill_samples(frame)) < 0)
+            goto end;
+        frame->pts = stats->samples_in;
+
+        stats->push_time[i % LATENCY_RING] = av_gettime_relative();
+        if ((ret = filter_stats_add_frame(&graph_stats, buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF)) < 0) {
+            printf("Error feeding filter chain: %s\n", av_err2str(ret));
+            goto end;
+        }
+        ++stats->frames_in;
+        stats->samples_in += frame->nb_samples;
+
+        if ((ret = drain_filters(filtered, stats)) < 0)
+            goto end;
+    }
+
+    if ((ret = filter_stats_add_frame(&graph_stats, buffersrc_ctx, NULL, 0)) < 0) {
+        printf("Error closing filter chain: %s\n", av_err2str(ret));
+        goto end;
+    }
+    // the sink normally reports EOF by itself, request_oldest only kicks a stalled graph
+    while ((ret = drain_filters(filtered, stats)) >= 0)
+        if ((ret = avfilter_graph_request_oldest(graph)) < 0)
+            break;
+    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+        ret = 0;
+    int64_t elapsed = FFMAX(av_gettime_relative() - start, 1);
+
+    printf("%"PRId64" frames / %"PRId64" samples in, %"PRId64" frames / %"PRId64" samples out in %.3f s\n",
+           stats->frames_in, stats->samples_in, stats->frames_out, stats->samples_out, elapsed / 1000000.0);
+    printf("%.0f samples/s in, %.0fx realtime\n", stats->samples_in * 1000000.0 / elapsed,
+           stats->samples_in * 1000000.0 / elapsed / sample_rate);
+    if (stats->frames_out)
+        printf("Latency per frame: avg %.1f us, max %"PRId64" us\n",
+               (double)stats->latency_sum / stats->frames_out, stats->latency_max);
+    filter_stats_print(&graph_stats, "Filter graph", 0);
+
+end:
+    av_frame_free(&frame);
+    av_frame_free(&filtered);
+    av_free(stats);
     return ret;
 }
 
@@ -152,6 +304,31 @@ int main(int argc, char *argv[])
 {
     int ret = 0;
 
+    // tone <seconds> <channels> <sample_format>: measure test signal synthesis speed
+    if (argc > 1 && argv[1] && !strcmp(argv[1], "tone")) {
+        double seconds = argc > 2 ? atof(argv[2]) : 3600;
+        int channels = argc > 3 ? atoi(argv[3]) : 2;
+        enum AVSampleFormat sample_fmt = argc > 4 ? av_get_sample_fmt(argv[4]) : AV_SAMPLE_FMT_FLTP;
+        if (channels <= 0 || sample_fmt == AV_SAMPLE_FMT_NONE) {
+            printf("Usage: %s tone [seconds] [channels] [s16|s16p|flt|fltp]\n", argv[0]);
+            return 1;
+        }
+        return tone_benchmark(seconds, channels, sample_fmt) < 0 ? 1 : 0;
+    }
+
+    // stream <nb_frames> <filterspec>: measure sustained filter throughput
+    if (argc > 1 && argv[1] && !strcmp(argv[1], "stream")) {
+        int nb_frames = argc > 2 ? atoi(argv[2]) : 10000;
+        const char *spec = argc > 3 ? argv[3] : "aresample=48000";
+        if ((ret = init_filters(spec)) >= 0)
+            ret = stream_filters(nb_frames);
+        avfilter_inout_free(&outputs);
+        avfilter_inout_free(&inputs);
+        filter_stats_uninit(&graph_stats);
+        avfilter_graph_free(&graph);
+        return ret < 0 ? 1 : 0;
+    }
+
     if (argc > 1 && argv[1]) {
         int level = atoi(argv[1]);
         av_log_set_level(level);
@@ -167,7 +344,9 @@ int main(int argc, char *argv[])
         printf("Failed to allocate frame buffer: %s\n", av_err2str(ret));
         goto end;
     }
-    fill_samples((uint16_t*)frame->data[0], sample_rate, nb_samples, frame->channels, 440.0);
+    tone_gen_init(&tone, 440.0, sample_rate, 10000.0f / 32767);
+    if ((ret = fill_samples(frame)) < 0)
+        goto end;
 
     char spec[64];
     snprintf(spec, sizeof(spec), "atrim=start_sample=128");
@@ -180,9 +359,10 @@ int main(int argc, char *argv[])
     printf("Trimmed from %d samples to %d\n", nb_samples, frame->nb_samples);
 
 end:
-    //av_frame_free(&frame);
+    av_frame_free(&frame);
     avfilter_inout_free(&outputs);
     avfilter_inout_free(&inputs);
+    filter_stats_uninit(&graph_stats);
     avfilter_graph_free(&graph);
 
     return ret;
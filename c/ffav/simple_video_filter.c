@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
@@ -6,6 +7,12 @@
 #include <libavutil/pixdesc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "filter_stats.h"
+#include "frame_gen.h"
+#include "frame_pool.h"
+#include "yuv_sink.h"
 
 static const enum AVPixelFormat format = AV_PIX_FMT_YUV420P;
 static const int height = 240;
@@ -16,52 +23,24 @@ static const int new_width = 200;
 static AVFilterContext *buffersrc_ctx, *buffersink_ctx;
 static AVFilterGraph *graph;
 static AVFilterInOut *outputs, *inputs;
+static YuvSink sink = { .fd = -1 };
+static FilterStats graph_stats;
 
-static void save_yuv_frame(AVFrame *frame, int frame_number)
-{
-    (void)frame_number;
-    char filename[32];
-    snprintf(filename, sizeof(filename), "frame.yuv");
-    FILE *file = fopen(filename, "ab");
-
-    uint32_t pitch_y = frame->linesize[0];
-    uint32_t pitch_u = frame->linesize[1];
-    uint32_t pitch_v = frame->linesize[2];
-
-    uint8_t *y = frame->data[0];
-    uint8_t *u = frame->data[1];
-    uint8_t *v = frame->data[2];
-
-    for (uint32_t i = 0; i < (uint32_t)frame->height; i++) {
-        fwrite(y, frame->width, 1, file);
-        y += pitch_y;
-    }
-
-    for (uint32_t i = 0; i < (uint32_t)frame->height/2; i++) {
-        fwrite(u, frame->width/2, 1, file);
-        u += pitch_u;
-    }
-
-    for (uint32_t i = 0; i < (uint32_t)frame->height/2; i++) {
-        fwrite(v, frame->width/2, 1, file);
-        v += pitch_v;
-    }
+// allocations made by this program, buffers allocated inside the graph are not counted
+static int64_t nb_frame_allocs;
+static int64_t nb_buffer_allocs;
 
-    fclose(file);
+static int save_yuv_frame(AVFrame *frame)
+{
+    int ret = yuv_sink_write(&sink, frame);
+    if (ret < 0)
+        printf("Failed to write frame: %s\n", av_err2str(ret));
+    return ret;
 }
 
 static void fill_yuv_frame(AVFrame *frame, int frame_index, int width, int height)
 {
-    for (int y = 0; y < height; y++)
-        for (int x = 0; x < width; x++)
-            frame->data[0][y * frame->linesize[0] + x] = x + y + frame_index * 3;
-
-    for (int y = 0; y < height / 2; y++) {
-        for (int x = 0; x < width / 2; x++) {
-            frame->data[1][y * frame->linesize[1] + x] = 128 + y + frame_index * 2;
-            frame->data[2][y * frame->linesize[2] + x] = 64 + x + frame_index * 5;
-        }
-    }
+    frame_gen_fill_yuv(frame->data, frame->linesize, width, height, frame_index);
 }
 
 static int init_filters(const char *spec)
@@ -124,6 +103,8 @@ static int init_filters(const char *spec)
         goto end;
     }
 
+    ret = filter_stats_init(&graph_stats, graph, 0);
+
 end:
     return ret;
 }
@@ -133,7 +114,7 @@ static int apply_filters(AVFrame *frame)
     int ret = 0;
     AVFrame* filtered = NULL;
 
-    if ((ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, 0)) < 0) {
+    if ((ret = filter_stats_add_frame(&graph_stats, buffersrc_ctx, frame, 0)) < 0) {
         printf("Error feeding filter chain: %s\n", av_err2str(ret));
         goto end;
     }
@@ -144,8 +125,9 @@ static int apply_filters(AVFrame *frame)
             ret = AVERROR(ENOMEM);
             break;
         }
+        ++nb_frame_allocs;
 
-        if ((ret = av_buffersink_get_frame(buffersink_ctx, filtered)) < 0) {
+        if ((ret = filter_stats_get_frame(&graph_stats, buffersink_ctx, filtered, 0)) < 0) {
             // not an error
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
                 ret = 0;
@@ -163,47 +145,120 @@ end:
     return ret;
 }
 
-int main(int argc, char *argv[])
+/**
+ * Same as apply_filters() with a caller owned output shell
+ * frame is left blank by buffersrc and receives the last filtered frame
+ */
+static int apply_filters_reuse(AVFrame *frame, AVFrame *filtered)
 {
     int ret = 0;
 
-    if (argc > 1 && argv[1]) {
-        int level = atoi(argv[1]);
-        av_log_set_level(level);
+    if ((ret = filter_stats_add_frame(&graph_stats, buffersrc_ctx, frame, 0)) < 0) {
+        printf("Error feeding filter chain: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    while ((ret = filter_stats_get_frame(&graph_stats, buffersink_ctx, filtered, 0)) >= 0) {
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, filtered);
     }
 
+    // not an error
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        ret = 0;
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    int legacy = 0;
+    FramePool pool = { 0 };
+    AVFrame *filtered = NULL;
+
+    // check: compare the SIMD frame generators against the scalar one
+    // legacy: allocate a frame and buffer per input and a frame per pull
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "check"))
+            return frame_gen_check() ? 1 : 0;
+        else if (!strcmp(argv[i], "legacy"))
+            legacy = 1;
+        else
+            av_log_set_level(atoi(argv[i]));
+    }
+
+    if ((ret = yuv_sink_open(&sink, "frame.yuv", 0)) < 0)
+        return ret;
+
+    char spec[128];
+    snprintf(spec, sizeof(spec), "scale=w=%d:h=%d", new_width, new_height);
+    if ((ret = init_filters(spec)) < 0)
+        goto end;
+
     AVFrame* frame = NULL;
-    for (int i = 0; i < 25; ++i) {
+    if (!legacy) {
+        // shells are allocated once, buffers come from the pool and only get allocated when it runs dry
         frame = av_frame_alloc();
-        frame->format = AV_PIX_FMT_YUV420P;
-        frame->width = width;
-        frame->height = height;
-        if ((ret = av_frame_get_buffer(frame, 32)) < 0) {
-            printf("Failed to allocate frame buffer: %s\n", av_err2str(ret));
+        filtered = av_frame_alloc();
+        if (!frame || !filtered) {
+            ret = AVERROR(ENOMEM);
             goto end;
         }
-        fill_yuv_frame(frame, i, width, height);
+        nb_frame_allocs += 2;
+    }
 
-        char spec[128];
-        snprintf(spec, sizeof(spec), "scale=w=%d:h=%d", new_width, new_height);
-        if ((ret = init_filters(spec)) < 0)
+    for (int i = 0; i < 25; ++i) {
+        if (legacy) {
+            frame = av_frame_alloc();
+            if (!frame) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            ++nb_frame_allocs;
+            frame->format = AV_PIX_FMT_YUV420P;
+            frame->width = width;
+            frame->height = height;
+            if ((ret = av_frame_get_buffer(frame, 32)) < 0) {
+                printf("Failed to allocate frame buffer: %s\n", av_err2str(ret));
+                goto end;
+            }
+            nb_buffer_allocs += av_pix_fmt_count_planes(format);
+        } else if ((ret = frame_pool_get(&pool, frame, format, width, height)) < 0) {
+            printf("Failed to get frame buffer from pool: %s\n", av_err2str(ret));
             goto end;
+        }
+        fill_yuv_frame(frame, i, width, height);
 
-        if ((ret = apply_filters(frame)) < 0)
+        if ((ret = legacy ? apply_filters(frame) : apply_filters_reuse(frame, filtered)) < 0)
             goto end;
 
-        save_yuv_frame(frame, i);
+        if ((ret = save_yuv_frame(frame)) < 0)
+            goto end;
 
-        av_frame_free(&frame);
+        if (legacy)
+            av_frame_free(&frame);
+        else
+            av_frame_unref(frame);
     }
 
+    nb_buffer_allocs += pool.nb_allocs;
+    printf("%s mode: %"PRId64" frame allocations, %"PRId64" buffer allocations for 25 frames\n",
+           legacy ? "Legacy" : "Reuse", nb_frame_allocs, nb_buffer_allocs);
+    if (!legacy)
+        frame_pool_print_stats(&pool, "Frame pool");
+    filter_stats_print(&graph_stats, "Filter graph", 0);
+
     printf("ffplay -f rawvideo -pix_fmt %s -video_size %dx%d %s\n", av_get_pix_fmt_name(format), new_width, new_height, "frame.yuv");
 
 end:
     av_frame_free(&frame);
+    av_frame_free(&filtered);
+    frame_pool_uninit(&pool);
     avfilter_inout_free(&outputs);
     avfilter_inout_free(&inputs);
+    filter_stats_uninit(&graph_stats);
     avfilter_graph_free(&graph);
+    yuv_sink_close(&sink);
 
     return ret;
 }
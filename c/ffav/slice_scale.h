@@ -0,0 +1,207 @@
+#ifndef SLICE_SCALE_H
+#define SLICE_SCALE_H
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * sws_scale() split into horizontal bands on a small thread pool
+ *
+ * Every band has its own SwsContext converting band_h source rows into band_h
+ * destination rows, so bands are only used when neither the height nor the
+ * chroma height changes (pixel format conversion within the same vertical
+ * subsampling, horizontal-only scaling) and both formats are software ones.
+ * Anything else runs as a single band on the calling thread. Band edges are
+ * aligned on chroma rows. Each band is a separate sws_scale() call, the output
+ * isn't guaranteed to be bit-exact with one call over the whole frame.
+ *
+ * The calling thread converts band 0, workers take the others.
+ */
+
+#define SLICE_SCALE_MAX 64
+
+typedef struct SliceScaler SliceScaler;
+
+typedef struct SliceScaleBand {
+    SliceScaler *s;
+    struct SwsContext *ctx;
+    int y; // first row
+    int h;
+    int ret; // of the last sws_scale()
+    pthread_t thread;
+} SliceScaleBand;
+
+struct SliceScaler {
+    int nb_bands;
+    SliceScaleBand bands[SLICE_SCALE_MAX];
+    int nb_threads_started;
+    enum AVPixelFormat src_fmt;
+    enum AVPixelFormat dst_fmt;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    int generation;
+    int nb_done;
+    int quit;
+    const AVFrame *src;
+    AVFrame *dst;
+};
+
+static inline void slice_scale_band(SliceScaler *s, SliceScaleBand *b)
+{
+    const uint8_t *src[4] = { NULL };
+    uint8_t *dst[4] = { NULL };
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(s->src_fmt);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(s->dst_fmt);
+
+    for (int i = 0; i < 4; ++i) {
+        if (s->src->data[i])
+            src[i] = s->src->data[i] + (ptrdiff_t)s->src->linesize[i] *
+                     ((i == 1 || i == 2) ? b->y >> src_desc->log2_chroma_h : b->y);
+        if (s->dst->data[i])
+            dst[i] = s->dst->data[i] + (ptrdiff_t)s->dst->linesize[i] *
+                     ((i == 1 || i == 2) ? b->y >> dst_desc->log2_chroma_h : b->y);
+    }
+    b->ret = sws_scale(b->ctx, src, s->src->linesize, 0, b->h, dst, s->dst->linesize);
+}
+
+static inline void *slice_scale_worker(void *arg)
+{
+    SliceScaleBand *b = arg;
+    SliceScaler *s = b->s;
+    int generation = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->quit && s->generation == generation)
+            pthread_cond_wait(&s->start_cond, &s->lock);
+        if (s->quit)
+            break;
+        generation = s->generation;
+        pthread_mutex_unlock(&s->lock);
+
+        slice_scale_band(s, b);
+
+        pthread_mutex_lock(&s->lock);
+        if (++s->nb_done == s->nb_bands - 1)
+            pthread_cond_signal(&s->done_cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static inline void slice_scaler_uninit(SliceScaler *s)
+{
+    if (s->nb_threads_started) {
+        pthread_mutex_lock(&s->lock);
+        s->quit = 1;
+        pthread_cond_broadcast(&s->start_cond);
+        pthread_mutex_unlock(&s->lock);
+        for (int i = 1; i <= s->nb_threads_started; ++i)
+            pthread_join(s->bands[i].thread, NULL);
+        s->nb_threads_started = 0;
+    }
+    if (s->nb_bands) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->start_cond);
+        pthread_cond_destroy(&s->done_cond);
+    }
+    for (int i = 0; i < s->nb_bands; ++i)
+        sws_freeContext(s->bands[i].ctx);
+    s->nb_bands = 0;
+}
+
+static inline int slice_scaler_init(SliceScaler *s, int nb_threads,
+                                    int src_w, int src_h, enum AVPixelFormat src_fmt,
+                                    int dst_w, int dst_h, enum AVPixelFormat dst_fmt, int flags)
+{
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src_fmt);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst_fmt);
+    if (!src_desc || !dst_desc)
+        return AVERROR(EINVAL);
+
+    memset(s, 0, sizeof(*s));
+    s->src_fmt = src_fmt;
+    s->dst_fmt = dst_fmt;
+
+    // bands of at least 16 rows, starting on a chroma row in both formats
+    int align = 1 << FFMAX(FFMAX(src_desc->log2_chroma_h, dst_desc->log2_chroma_h), 4);
+    int nb_bands = FFMIN(FFMAX(nb_threads, 1), SLICE_SCALE_MAX);
+    nb_bands = FFMIN(nb_bands, FFMAX(src_h / align, 1));
+    if (src_h != dst_h || src_desc->log2_chroma_h != dst_desc->log2_chroma_h ||
+        (src_desc->flags & AV_PIX_FMT_FLAG_HWACCEL) || (dst_desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+        nb_bands = 1;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->start_cond, NULL);
+    pthread_cond_init(&s->done_cond, NULL);
+
+    for (int i = 0; i < nb_bands; ++i) {
+        SliceScaleBand *b = &s->bands[i];
+        int y0 = i ? FFALIGN(src_h * i / nb_bands, align) : 0;
+        int y1 = i < nb_bands - 1 ? FFALIGN(src_h * (i + 1) / nb_bands, align) : src_h;
+        b->s = s;
+        b->y = y0;
+        b->h = nb_bands > 1 ? y1 - y0 : src_h;
+        b->ctx = sws_getContext(src_w, b->h, src_fmt, dst_w, nb_bands > 1 ? b->h : dst_h, dst_fmt,
+                                flags, NULL, NULL, NULL);
+        s->nb_bands = i + 1;
+        if (!b->ctx) {
+            fprintf(stderr, "Can't create scaler context for fmt:%s s:%dx%d -> fmt:%s s:%dx%d\n",
+                    src_desc->name, src_w, b->h, dst_desc->name, dst_w, b->h);
+            slice_scaler_uninit(s);
+            return AVERROR(EINVAL);
+        }
+    }
+
+    for (int i = 1; i < s->nb_bands; ++i) {
+        if (pthread_create(&s->bands[i].thread, NULL, slice_scale_worker, &s->bands[i])) {
+            slice_scaler_uninit(s);
+            return AVERROR(EAGAIN);
+        }
+        s->nb_threads_started = i;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the first band's negative sws_scale() result, 0 on success
+ */
+static inline int slice_scaler_scale(SliceScaler *s, const AVFrame *src, AVFrame *dst)
+{
+    s->src = src;
+    s->dst = dst;
+    if (s->nb_bands == 1) {
+        slice_scale_band(s, &s->bands[0]);
+        return FFMIN(s->bands[0].ret, 0);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->nb_done = 0;
+    ++s->generation;
+    pthread_cond_broadcast(&s->start_cond);
+    pthread_mutex_unlock(&s->lock);
+
+    slice_scale_band(s, &s->bands[0]);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->nb_done < s->nb_bands - 1)
+        pthread_cond_wait(&s->done_cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < s->nb_bands; ++i)
+        if (s->bands[i].ret < 0)
+            return s->bands[i].ret;
+    return 0;
+}
+
+#endif // SLICE_SCALE_H
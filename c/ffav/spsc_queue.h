@@ -0,0 +1,97 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * Bounded lock-free single producer single consumer queue of pointers
+ *
+ * Exactly one thread may push and exactly one thread may pop. NULL is a valid
+ * item, the pipelines use it as an EOF marker. The *_wait variants spin (with
+ * sched_yield) until they succeed or *stop becomes non-zero.
+ */
+
+typedef struct SpscQueue {
+    // written by the consumer only
+    _Alignas(64) atomic_size_t head;
+    // written by the producer only
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) size_t mask;
+    void **items;
+} SpscQueue;
+
+static inline int spsc_queue_init(SpscQueue *q, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    q->items = av_malloc_array(size, sizeof(*q->items));
+    if (!q->items)
+        return AVERROR(ENOMEM);
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+static inline void spsc_queue_uninit(SpscQueue *q)
+{
+    av_freep(&q->items);
+}
+
+static inline int spsc_queue_push(SpscQueue *q, void *item)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head > q->mask)
+        return AVERROR(EAGAIN);
+
+    q->items[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+static inline int spsc_queue_pop(SpscQueue *q, void **item)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail)
+        return AVERROR(EAGAIN);
+
+    *item = q->items[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 0;
+}
+
+static inline size_t spsc_queue_size(SpscQueue *q)
+{
+    return atomic_load_explicit(&q->tail, memory_order_acquire) -
+           atomic_load_explicit(&q->head, memory_order_acquire);
+}
+
+static inline int spsc_queue_push_wait(SpscQueue *q, void *item, atomic_int *stop)
+{
+    while (spsc_queue_push(q, item) < 0) {
+        if (atomic_load_explicit(stop, memory_order_relaxed))
+            return AVERROR_EXIT;
+        sched_yield();
+    }
+    return 0;
+}
+
+static inline int spsc_queue_pop_wait(SpscQueue *q, void **item, atomic_int *stop)
+{
+    while (spsc_queue_pop(q, item) < 0) {
+        if (atomic_load_explicit(stop, memory_order_relaxed))
+            return AVERROR_EXIT;
+        sched_yield();
+    }
+    return 0;
+}
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,133 @@
+#ifndef TONE_GEN_H
+#define TONE_GEN_H
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Sine tone generator for test audio
+ *
+ * The phase is tracked in double precision (phase accumulator) and each block
+ * of TONE_BLOCK samples is produced by TONE_LANES oscillators running side by
+ * side, lane k holding sample n + k as a unit phasor that gets rotated by
+ * TONE_LANES * phase_inc per step. The rotation is a complex multiply on float
+ * vectors, so libm is only called to anchor the lanes once per block and the
+ * float error can't build up over long runs.
+ *
+ * Output is written for any channel count in S16, S16P, FLT and FLTP, every
+ * channel carries the same tone.
+ */
+
+#define TONE_LANES 8
+#define TONE_BLOCK 1024
+#define TONE_TWO_PI 6.28318530717958647692
+
+typedef float ToneVec __attribute__((vector_size(TONE_LANES * sizeof(float))));
+
+typedef struct ToneGen {
+    double phase;
+    double phase_inc;
+    float amplitude; // full scale is 1.0
+    float block[TONE_BLOCK] __attribute__((aligned(32)));
+} ToneGen;
+
+static inline void tone_gen_init(ToneGen *t, double frequency, int sample_rate, float amplitude)
+{
+    t->phase = 0;
+    t->phase_inc = TONE_TWO_PI * frequency / sample_rate;
+    t->amplitude = amplitude;
+}
+
+/**
+ * Generate up to TONE_BLOCK mono samples into t->block
+ */
+static inline void tone_gen_block(ToneGen *t, int nb_samples)
+{
+    ToneVec re, im;
+    for (int k = 0; k < TONE_LANES; ++k) {
+        double p = t->phase + k * t->phase_inc;
+        re[k] = cos(p);
+        im[k] = sin(p);
+    }
+    const float rot_re = cos(TONE_LANES * t->phase_inc);
+    const float rot_im = sin(TONE_LANES * t->phase_inc);
+    const float amplitude = t->amplitude;
+
+    int n = 0;
+    for (; n + TONE_LANES <= nb_samples; n += TONE_LANES) {
+        ToneVec out = im * amplitude;
+        memcpy(t->block + n, &out, sizeof(out));
+        ToneVec next_re = re * rot_re - im * rot_im;
+        im = re * rot_im + im * rot_re;
+        re = next_re;
+    }
+    for (int k = 0; n < nb_samples; ++n, ++k)
+        t->block[n] = im[k] * amplitude;
+
+    t->phase = fmod(t->phase + nb_samples * t->phase_inc, TONE_TWO_PI);
+}
+
+static inline int16_t tone_gen_to_s16(float v)
+{
+    // amplitude is at most 1.0, so this can't overflow
+    return (int16_t)lrintf(v * 32767.0f);
+}
+
+/**
+ * Fill frame->nb_samples samples of every channel of an allocated audio frame
+ */
+static inline int tone_gen_fill_frame(ToneGen *t, AVFrame *frame)
+{
+    const int channels = frame->channels;
+    const enum AVSampleFormat format = frame->format;
+
+    if (format != AV_SAMPLE_FMT_S16 && format != AV_SAMPLE_FMT_S16P &&
+        format != AV_SAMPLE_FMT_FLT && format != AV_SAMPLE_FMT_FLTP)
+        return AVERROR(ENOSYS);
+
+    for (int offset = 0; offset < frame->nb_samples; offset += TONE_BLOCK) {
+        const int n = FFMIN(TONE_BLOCK, frame->nb_samples - offset);
+        const float *src = t->block;
+        tone_gen_block(t, n);
+
+        switch (format) {
+        case AV_SAMPLE_FMT_FLTP:
+            for (int c = 0; c < channels; ++c)
+                memcpy((float *)frame->extended_data[c] + offset, src, n * sizeof(*src));
+            break;
+        case AV_SAMPLE_FMT_S16P: {
+            int16_t *dst = (int16_t *)frame->extended_data[0] + offset;
+            for (int i = 0; i < n; ++i)
+                dst[i] = tone_gen_to_s16(src[i]);
+            for (int c = 1; c < channels; ++c)
+                memcpy((int16_t *)frame->extended_data[c] + offset, dst, n * sizeof(*dst));
+            break;
+        }
+        case AV_SAMPLE_FMT_FLT: {
+            float *dst = (float *)frame->data[0] + (size_t)offset * channels;
+            for (int i = 0; i < n; ++i, dst += channels)
+                for (int c = 0; c < channels; ++c)
+                    dst[c] = src[i];
+            break;
+        }
+        default: {
+            int16_t *dst = (int16_t *)frame->data[0] + (size_t)offset * channels;
+            for (int i = 0; i < n; ++i, dst += channels) {
+                int16_t v = tone_gen_to_s16(src[i]);
+                for (int c = 0; c < channels; ++c)
+                    dst[c] = v;
+            }
+            break;
+        }
+        }
+    }
+
+    return 0;
+}
+
+#endif // TONE_GEN_H
@@ -0,0 +1,210 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Timeline tracing, written in the Chrome trace_event JSON format (chrome://tracing, ui.perfetto.dev)
+ *
+ * Every thread records into its own ring, allocated on its first event, so an
+ * event is a clock read and a few stores, no lock. A full ring overwrites its
+ * oldest events: the last TRACE_RING_SIZE of each thread are kept. Only the
+ * name pointer is stored, names must be string literals (no quotes or backslashes).
+ * While tracing is off every macro comes down to one branch on trace_enabled.
+ * A ring that wrapped can have lost the 'B' of a span whose 'E' it kept, such
+ * 'E' events are dropped when writing.
+ *
+ * TRACE_SCOPE() times the rest of the enclosing block, it relies on the cleanup
+ * attribute so no goto may jump into that block past it. TRACE_BEGIN() /
+ * TRACE_END() are for spans that aren't a block, on the same thread.
+ */
+
+#define TRACE_RING_SIZE (1 << 16)
+
+typedef struct TraceEvent {
+    const char *name;
+    int64_t ts; // ns, CLOCK_MONOTONIC
+    int64_t dur; // ns, complete events only
+    char ph; // 'X' complete, 'B' begin, 'E' end, 'i' instant
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int tid;
+    char thread_name[32];
+    uint64_t nb_events; // ever recorded, the ring holds the last TRACE_RING_SIZE
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceBuffer;
+
+typedef struct TraceScope {
+    const char *name;
+    int64_t start; // 0 when tracing was off at the start of the scope
+} TraceScope;
+
+static int trace_enabled;
+static int64_t trace_origin;
+static TraceBuffer *trace_buffers; // every thread's, protected by trace_lock
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceBuffer *trace_tls;
+
+static inline int64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline TraceBuffer *trace_buffer(void)
+{
+    if (trace_tls)
+        return trace_tls;
+
+    TraceBuffer *tb = calloc(1, sizeof(*tb));
+    if (!tb)
+        return NULL;
+    tb->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&trace_lock);
+    tb->next = trace_buffers;
+    trace_buffers = tb;
+    pthread_mutex_unlock(&trace_lock);
+
+    return trace_tls = tb;
+}
+
+static inline void trace_event(const char *name, char ph, int64_t ts, int64_t dur)
+{
+    TraceBuffer *tb;
+    // a scope or span begun before trace_finish() must not touch the freed rings
+    if (trace_enabled && (tb = trace_buffer()))
+        tb->events[tb->nb_events++ % TRACE_RING_SIZE] = (TraceEvent){ .name = name, .ts = ts, .dur = dur, .ph = ph };
+}
+
+static inline void trace_scope_end(TraceScope *s)
+{
+    if (s->start)
+        trace_event(s->name, 'X', s->start, trace_now_ns() - s->start);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#define TRACE_SCOPE(_name)                                                                    \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_scope_end))) = \
+        { .name = (_name), .start = __builtin_expect(trace_enabled, 0) ? trace_now_ns() : 0 }
+
+#define TRACE_EVENT_(_name, _ph)                                 \
+    do {                                                         \
+        if (__builtin_expect(trace_enabled, 0))                  \
+            trace_event((_name), (_ph), trace_now_ns(), 0);      \
+    } while (0)
+
+#define TRACE_BEGIN(_name) TRACE_EVENT_(_name, 'B')
+#define TRACE_END(_name) TRACE_EVENT_(_name, 'E')
+#define TRACE_INSTANT(_name) TRACE_EVENT_(_name, 'i')
+
+/**
+ * Name the calling thread in the trace, cheap enough to call per task
+ */
+static inline void trace_thread_name(const char *name)
+{
+    TraceBuffer *tb;
+    if (trace_enabled && (tb = trace_buffer()) && strcmp(tb->thread_name, name))
+        snprintf(tb->thread_name, sizeof(tb->thread_name), "%s", name);
+}
+
+static inline void trace_start(void)
+{
+    trace_origin = trace_now_ns();
+    trace_enabled = 1;
+}
+
+/**
+ * Stop recording, write every thread's events to path and free the rings
+ * Every other thread that recorded events must have been joined, only the
+ * calling thread's ring pointer is reset. Tracing can't be started again.
+ */
+static inline int trace_finish(const char *path)
+{
+    int64_t nb_events = 0, nb_lost = 0;
+    int nb_threads = 0;
+    int ret = 0;
+
+    if (!trace_enabled)
+        return 0;
+    trace_enabled = 0;
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Can't open trace file %s\n", path);
+        ret = -1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (f)
+        fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    int pid = getpid();
+    const char *sep = "";
+    while (trace_buffers) {
+        TraceBuffer *tb = trace_buffers;
+        uint64_t first = tb->nb_events > TRACE_RING_SIZE ? tb->nb_events - TRACE_RING_SIZE : 0;
+        int depth = 0; // 'B' events kept and not ended yet
+
+        if (f && tb->thread_name[0]) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    sep, pid, tb->tid, tb->thread_name);
+            sep = ",\n";
+        }
+        for (uint64_t i = first; f && i < tb->nb_events; ++i) {
+            const TraceEvent *e = &tb->events[i % TRACE_RING_SIZE];
+            if (e->ph == 'B') {
+                ++depth;
+            } else if (e->ph == 'E') {
+                // its 'B' was overwritten
+                if (!depth)
+                    continue;
+                --depth;
+            }
+            ++nb_events;
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", sep,
+                    e->name, e->ph, pid, tb->tid, (e->ts - trace_origin) / 1e3);
+            if (e->ph == 'X')
+                fprintf(f, ",\"dur\":%.3f", e->dur / 1e3);
+            else if (e->ph == 'i')
+                fprintf(f, ",\"s\":\"t\"");
+            fputc('}', f);
+            sep = ",\n";
+        }
+
+        nb_lost += first;
+        ++nb_threads;
+        trace_buffers = tb->next;
+        free(tb);
+    }
+    trace_tls = NULL;
+    pthread_mutex_unlock(&trace_lock);
+
+    if (f) {
+        fprintf(f, "\n]}\n");
+        if (fclose(f)) {
+            fprintf(stderr, "Error writing trace file %s\n", path);
+            ret = -1;
+        } else {
+            printf("Trace: %"PRId64" events of %d threads written to %s", nb_events, nb_threads, path);
+            if (nb_lost)
+                printf(", %"PRId64" older ones overwritten", nb_lost);
+            printf("\n");
+        }
+    }
+
+    return ret;
+}
+
+#endif // TRACE_H
@@ -0,0 +1,133 @@
+#ifndef TS_ENGINE_H
+#define TS_ENGINE_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+#include <libavutil/mathematics.h>
+
+/**
+ * Timestamp engine for recording live inputs
+ *
+ * InputClock maps the timestamps of one input onto the monotonic clock
+ * (microseconds, av_gettime_relative()): the first packet is anchored to the
+ * time it arrived and later ones follow the input dts, so packets keep the
+ * input spacing instead of the arrival jitter. The arrival time of every
+ * packet slowly pulls the mapping along to absorb the drift between the
+ * sender clock and ours, and a jump larger than TS_RESYNC_THRESHOLD
+ * (discontinuity, wrap, stalled source) re-anchors it. All streams of an
+ * input share its clock, so they stay in sync with each other.
+ *
+ * StreamTs turns that clock time into output pts/dts for one output stream,
+ * keeping the input pts - dts (reordering) and guaranteeing dts only goes up.
+ */
+
+#define TS_RESYNC_THRESHOLD 500000 // microseconds
+#define TS_DRIFT_SHIFT 6 // each packet corrects 1/64th of the error
+#define TS_MAX_SLEW 200 // microseconds of correction per packet at most
+
+typedef struct InputClock {
+    int64_t start_time; // clock time of the first packet
+    int64_t first_dts; // AV_TIME_BASE units, AV_NOPTS_VALUE until the first packet
+    int64_t offset; // drift correction
+    int in_sync; // arrivals kept up with the mapping for a while, never set when reading faster than real time
+    int nb_resyncs;
+} InputClock;
+
+typedef struct StreamTs {
+    int64_t last_dts; // in time_base, AV_NOPTS_VALUE until the first packet
+    AVRational time_base;
+    int nb_fixups; // dts that had to be pushed forward
+} StreamTs;
+
+static inline void input_clock_init(InputClock *ic)
+{
+    ic->start_time = 0;
+    ic->first_dts = AV_NOPTS_VALUE;
+    ic->offset = 0;
+    ic->in_sync = 0;
+    ic->nb_resyncs = 0;
+}
+
+/**
+ * Clock time the packet belongs at according to the input timestamps
+ * now is only used for the first packet and packets without dts
+ */
+static inline int64_t input_clock_predict(InputClock *ic, int64_t dts, AVRational time_base, int64_t now)
+{
+    if (dts == AV_NOPTS_VALUE)
+        return now;
+
+    dts = av_rescale_q(dts, time_base, AV_TIME_BASE_Q);
+    if (ic->first_dts == AV_NOPTS_VALUE) {
+        ic->first_dts = dts;
+        ic->start_time = now;
+    }
+
+    return ic->start_time + dts - ic->first_dts + ic->offset;
+}
+
+/**
+ * Feed the arrival time of the packet predicted at key, returns the corrected key
+ *
+ * A packet arriving much later than predicted (source stalled, timestamps went
+ * back) re-anchors the clock; much earlier (timestamps jumped ahead) only does
+ * if arrivals were in sync so far, otherwise the input is simply read faster
+ * than real time (a file) and there is no drift to measure.
+ */
+static inline int64_t input_clock_correct(InputClock *ic, int64_t key, int64_t arrival)
+{
+    int64_t err = arrival - key;
+
+    if (err > TS_RESYNC_THRESHOLD || (err < -TS_RESYNC_THRESHOLD && ic->in_sync)) {
+        ic->offset += err;
+        ++ic->nb_resyncs;
+        return arrival;
+    }
+    if (err < -TS_RESYNC_THRESHOLD)
+        return key;
+
+    // a file read ahead of real time is well past the threshold before this
+    if (arrival - ic->start_time > 2 * TS_RESYNC_THRESHOLD)
+        ic->in_sync = 1;
+    ic->offset += av_clip64(err >> TS_DRIFT_SHIFT, -TS_MAX_SLEW, TS_MAX_SLEW);
+    return key;
+}
+
+static inline void stream_ts_init(StreamTs *st)
+{
+    st->last_dts = AV_NOPTS_VALUE;
+    st->time_base = (AVRational){ 0, 1 };
+    st->nb_fixups = 0;
+}
+
+/**
+ * Set pkt pts/dts in out_tb from its clock time (relative to the start of the recording)
+ * pkt still has its input timestamps in in_tb, pts keeps its distance to dts
+ */
+static inline void stream_ts_map(StreamTs *st, AVPacket *pkt, int64_t clock_time,
+                                 AVRational in_tb, AVRational out_tb)
+{
+    int64_t dts = av_rescale_q(clock_time, AV_TIME_BASE_Q, out_tb);
+    int64_t pts = dts;
+    if (pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE)
+        pts += av_rescale_q(pkt->pts - pkt->dts, in_tb, out_tb);
+
+    if (st->last_dts != AV_NOPTS_VALUE) {
+        if (av_cmp_q(st->time_base, out_tb))
+            st->last_dts = av_rescale_q(st->last_dts, st->time_base, out_tb);
+        if (dts <= st->last_dts) {
+            int64_t shift = st->last_dts + 1 - dts;
+            dts += shift;
+            pts += shift;
+            ++st->nb_fixups;
+        }
+    }
+
+    pkt->dts = dts;
+    pkt->pts = FFMAX(pts, dts);
+    st->last_dts = dts;
+    st->time_base = out_tb;
+}
+
+#endif // TS_ENGINE_H
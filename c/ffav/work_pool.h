@@ -0,0 +1,150 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * Work-stealing pool for a fixed set of independent tasks
+ *
+ * Tasks 0..nb_tasks-1 are dealt round-robin into one deque per worker. A worker
+ * takes its own tasks from the front, and once it runs dry steals from the back
+ * of the other deques, so a worker stuck on a long task doesn't hold up the ones
+ * queued behind it. Tasks are integers, the callback maps them to its own data.
+ */
+
+typedef void (*WorkFunc)(void *opaque, int task, int worker);
+
+typedef struct WorkDeque {
+    pthread_mutex_t lock;
+    int *tasks;
+    int head;
+    int tail;
+} WorkDeque;
+
+typedef struct WorkPool WorkPool;
+
+typedef struct WorkWorker {
+    WorkPool *pool;
+    int index;
+    pthread_t thread;
+} WorkWorker;
+
+struct WorkPool {
+    int nb_workers;
+    WorkDeque *deques;
+    WorkWorker *workers;
+    WorkFunc func;
+    void *opaque;
+    atomic_int nb_steals;
+};
+
+static inline int work_deque_pop_front(WorkDeque *d)
+{
+    int task = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+        task = d->tasks[d->head++];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static inline int work_deque_pop_back(WorkDeque *d)
+{
+    int task = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+        task = d->tasks[--d->tail];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static inline void *work_pool_worker(void *arg)
+{
+    WorkWorker *w = arg;
+    WorkPool *p = w->pool;
+
+    for (;;) {
+        int task = work_deque_pop_front(&p->deques[w->index]);
+        // nothing left locally, look at the other workers in turn
+        for (int i = 1; task < 0 && i < p->nb_workers; ++i) {
+            task = work_deque_pop_back(&p->deques[(w->index + i) % p->nb_workers]);
+            if (task >= 0)
+                atomic_fetch_add(&p->nb_steals, 1);
+        }
+        // tasks are never added once the pool runs, so every deque is empty
+        if (task < 0)
+            break;
+        p->func(p->opaque, task, w->index);
+    }
+
+    return NULL;
+}
+
+/**
+ * Run func(opaque, task, worker) for every task on nb_workers threads and wait for all of them
+ * nb_steals (may be NULL) receives how many tasks ran on another worker than the one they were dealt to
+ */
+static inline int work_pool_run(int nb_workers, int nb_tasks, WorkFunc func, void *opaque, int *nb_steals)
+{
+    WorkPool p = { .nb_workers = nb_workers, .func = func, .opaque = opaque };
+    int nb_started = 0;
+    int ret = 0;
+
+    if (nb_workers < 1 || nb_tasks < 0)
+        return AVERROR(EINVAL);
+
+    p.deques = av_mallocz_array(nb_workers, sizeof(*p.deques));
+    p.workers = av_mallocz_array(nb_workers, sizeof(*p.workers));
+    if (!p.deques || !p.workers) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    atomic_init(&p.nb_steals, 0);
+    for (int i = 0; i < nb_workers; ++i)
+        pthread_mutex_init(&p.deques[i].lock, NULL);
+
+    for (int i = 0; i < nb_workers; ++i) {
+        WorkDeque *d = &p.deques[i];
+        d->tasks = av_malloc_array(nb_tasks / nb_workers + 1, sizeof(*d->tasks));
+        if (!d->tasks) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    for (int t = 0; t < nb_tasks; ++t) {
+        WorkDeque *d = &p.deques[t % nb_workers];
+        d->tasks[d->tail++] = t;
+    }
+
+    for (int i = 0; i < nb_workers; ++i) {
+        p.workers[i].pool = &p;
+        p.workers[i].index = i;
+        if (pthread_create(&p.workers[i].thread, NULL, work_pool_worker, &p.workers[i])) {
+            // the threads already running steal the tasks of the missing ones
+            ret = nb_started ? 0 : AVERROR(EAGAIN);
+            break;
+        }
+        ++nb_started;
+    }
+    for (int i = 0; i < nb_started; ++i)
+        pthread_join(p.workers[i].thread, NULL);
+
+    if (nb_steals)
+        *nb_steals = atomic_load(&p.nb_steals);
+
+end:
+    if (p.deques) {
+        for (int i = 0; i < nb_workers; ++i) {
+            pthread_mutex_destroy(&p.deques[i].lock);
+            av_freep(&p.deques[i].tasks);
+        }
+    }
+    av_freep(&p.deques);
+    av_freep(&p.workers);
+    return ret;
+}
+
+#endif // WORK_POOL_H
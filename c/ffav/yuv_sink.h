@@ -0,0 +1,225 @@
+#ifndef YUV_SINK_H
+#define YUV_SINK_H
+
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Raw video file writer
+ *
+ * Keeps the file open for the whole run. Planes whose linesize matches their
+ * width go out as a single chunk, padded planes are gathered row by row into
+ * an iovec array and written with writev().
+ *
+ * In direct mode the file is opened with O_DIRECT and rows are copied into an
+ * aligned staging buffer that is written out in full blocks, so large dumps
+ * bypass the page cache. Filesystems that refuse O_DIRECT (e.g. tmpfs) fall
+ * back to buffered writes.
+ */
+
+#ifndef O_DIRECT
+#error "define _GNU_SOURCE before the first include to get O_DIRECT"
+#endif
+
+#define YUV_SINK_ALIGN 4096
+#define YUV_SINK_DIRECT_BUF (4 << 20)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct YuvSink {
+    int fd;
+    int direct;
+    uint8_t *buf; // direct mode staging buffer
+    size_t buf_used;
+    struct iovec iov[IOV_MAX];
+    int nb_iov;
+    int64_t nb_frames;
+    int64_t nb_bytes;
+    int64_t nb_writes; // write()/writev() calls
+} YuvSink;
+
+static inline int yuv_sink_write_all(YuvSink *s, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(s->fd, data, size);
+        ++s->nb_writes;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static inline int yuv_sink_flush_iov(YuvSink *s)
+{
+    struct iovec *iov = s->iov;
+    int nb_iov = s->nb_iov;
+
+    s->nb_iov = 0;
+    while (nb_iov > 0) {
+        ssize_t n = writev(s->fd, iov, nb_iov);
+        ++s->nb_writes;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        // skip what was written, short writes can stop in the middle of a row
+        while (nb_iov > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --nb_iov;
+        }
+        if (nb_iov > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static inline int yuv_sink_flush_direct(YuvSink *s, int final)
+{
+    int ret = 0;
+    size_t aligned = s->buf_used & ~(size_t)(YUV_SINK_ALIGN - 1);
+
+    if (aligned && (ret = yuv_sink_write_all(s, s->buf, aligned)) < 0)
+        return ret;
+
+    s->buf_used -= aligned;
+    if (s->buf_used) {
+        if (final) {
+            // O_DIRECT can't write a partial block, finish the file with a buffered write
+            fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_DIRECT);
+            ret = yuv_sink_write_all(s, s->buf + aligned, s->buf_used);
+            s->buf_used = 0;
+        } else {
+            memmove(s->buf, s->buf + aligned, s->buf_used);
+        }
+    }
+    return ret;
+}
+
+static inline int yuv_sink_add(YuvSink *s, const uint8_t *data, size_t size)
+{
+    int ret = 0;
+
+    if (s->direct) {
+        while (size > 0) {
+            size_t n = FFMIN(size, YUV_SINK_DIRECT_BUF - s->buf_used);
+            memcpy(s->buf + s->buf_used, data, n);
+            s->buf_used += n;
+            data += n;
+            size -= n;
+            if (s->buf_used == YUV_SINK_DIRECT_BUF && (ret = yuv_sink_flush_direct(s, 0)) < 0)
+                return ret;
+        }
+        return 0;
+    }
+
+    if (s->nb_iov == IOV_MAX && (ret = yuv_sink_flush_iov(s)) < 0)
+        return ret;
+    s->iov[s->nb_iov].iov_base = (void *)data;
+    s->iov[s->nb_iov].iov_len = size;
+    ++s->nb_iov;
+    return 0;
+}
+
+static inline int yuv_sink_open(YuvSink *s, const char *filename, int direct)
+{
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+
+    if (direct) {
+        s->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (s->fd < 0 && errno == EINVAL)
+            printf("O_DIRECT not supported for %s, using buffered writes\n", filename);
+        else if (s->fd >= 0 && posix_memalign((void **)&s->buf, YUV_SINK_ALIGN, YUV_SINK_DIRECT_BUF)) {
+            printf("No aligned buffer for O_DIRECT, using buffered writes\n");
+            close(s->fd);
+            s->fd = -1;
+            s->buf = NULL;
+        }
+    }
+    if (s->fd < 0)
+        s->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (s->fd < 0) {
+        int ret = AVERROR(errno);
+        printf("Could not open %s: %s\n", filename, av_err2str(ret));
+        return ret;
+    }
+    s->direct = !!s->buf;
+
+    return 0;
+}
+
+/**
+ * Append the visible part of a planar frame
+ * frame data must stay valid until this returns
+ */
+static inline int yuv_sink_write(YuvSink *s, const AVFrame *frame)
+{
+    int ret = 0;
+    int linesize[4];
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    if (!desc || desc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+        return AVERROR(EINVAL);
+    if ((ret = av_image_fill_linesizes(linesize, frame->format, frame->width)) < 0)
+        return ret;
+
+    for (int i = 0; i < 4 && frame->data[i]; ++i) {
+        int h = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+        const uint8_t *data = frame->data[i];
+
+        if (frame->linesize[i] == linesize[i]) {
+            ret = yuv_sink_add(s, data, (size_t)linesize[i] * h);
+        } else {
+            for (int y = 0; y < h && ret >= 0; ++y, data += frame->linesize[i])
+                ret = yuv_sink_add(s, data, linesize[i]);
+        }
+        if (ret < 0)
+            return ret;
+        s->nb_bytes += (int64_t)linesize[i] * h;
+    }
+
+    if (!s->direct && (ret = yuv_sink_flush_iov(s)) < 0)
+        return ret;
+
+    ++s->nb_frames;
+    return 0;
+}
+
+static inline int yuv_sink_close(YuvSink *s)
+{
+    int ret = 0;
+    if (s->fd < 0)
+        return 0;
+
+    if (s->direct)
+        ret = yuv_sink_flush_direct(s, 1);
+    if (close(s->fd) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+    s->fd = -1;
+    free(s->buf);
+    s->buf = NULL;
+
+    return ret;
+}
+
+#endif // YUV_SINK_H
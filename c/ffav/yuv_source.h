@@ -0,0 +1,138 @@
+#ifndef YUV_SOURCE_H
+#define YUV_SOURCE_H
+
+#include <libavutil/buffer.h>
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Memory mapped raw video file reader
+ *
+ * Frames are wrapped in place: the AVFrame planes point straight into the
+ * mapping through a read-only AVBufferRef whose free callback does nothing.
+ * Filters that need to write into their input (e.g. the main input of overlay)
+ * get a copy from libavfilter, everything else reads the page cache directly.
+ *
+ * The mapping has to outlive every frame handed out, i.e. close the source
+ * after freeing the filter graph.
+ */
+
+typedef struct YuvSource {
+    uint8_t *map;
+    size_t size;
+    enum AVPixelFormat format;
+    int width;
+    int height;
+    int linesize[4];
+    size_t plane_offset[4];
+    size_t frame_size;
+    int nb_frames;
+} YuvSource;
+
+static inline void yuv_source_buffer_free(void *opaque, uint8_t *data)
+{
+    // the mapping belongs to the YuvSource
+    (void)opaque;
+    (void)data;
+}
+
+static inline void yuv_source_close(YuvSource *s)
+{
+    if (s->map)
+        munmap(s->map, s->size);
+    s->map = NULL;
+    s->nb_frames = 0;
+}
+
+static inline int yuv_source_open(YuvSource *s, const char *filename, enum AVPixelFormat format, int width, int height)
+{
+    int ret = 0;
+    uint8_t *data[4];
+    struct stat st;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (!desc || desc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+        return AVERROR(EINVAL);
+
+    memset(s, 0, sizeof(*s));
+    s->format = format;
+    s->width = width;
+    s->height = height;
+
+    // planes are packed back to back, like the YUV sink writes them
+    if ((ret = av_image_fill_linesizes(s->linesize, format, width)) < 0)
+        return ret;
+    if ((ret = av_image_fill_pointers(data, format, height, NULL, s->linesize)) < 0)
+        return ret;
+    s->frame_size = ret;
+    for (int i = 0; i < 4; ++i)
+        s->plane_offset[i] = data[i] ? (size_t)(data[i] - data[0]) : 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        printf("Could not open %s: %s\n", filename, av_err2str(ret));
+        return ret;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = AVERROR(errno);
+        close(fd);
+        return ret;
+    }
+
+    s->nb_frames = st.st_size / s->frame_size;
+    if (!s->nb_frames) {
+        printf("%s is smaller than one %dx%d %s frame\n", filename, width, height, desc->name);
+        close(fd);
+        return AVERROR_INVALIDDATA;
+    }
+
+    s->size = s->nb_frames * s->frame_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        ret = AVERROR(errno);
+        s->map = NULL;
+        printf("Could not map %s: %s\n", filename, av_err2str(ret));
+        return ret;
+    }
+    madvise(s->map, s->size, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+/**
+ * Point a blank frame at frame frame_index of the file, no pixel is copied
+ * Returns AVERROR_EOF past the last frame
+ */
+static inline int yuv_source_read(YuvSource *s, AVFrame *frame, int frame_index)
+{
+    if (frame_index < 0 || frame_index >= s->nb_frames)
+        return AVERROR_EOF;
+
+    uint8_t *base = s->map + frame_index * s->frame_size;
+    frame->buf[0] = av_buffer_create(base, s->frame_size, yuv_source_buffer_free, NULL, AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+
+    frame->format = s->format;
+    frame->width = s->width;
+    frame->height = s->height;
+    for (int i = 0; i < 4 && s->linesize[i]; ++i) {
+        frame->data[i] = base + s->plane_offset[i];
+        frame->linesize[i] = s->linesize[i];
+    }
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+#endif // YUV_SOURCE_H